@@ -164,6 +164,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/key.h \
     src/db.h \
     src/walletdb.h \
+    src/walletlog.h \
     src/script.h \
     src/init.h \
     src/bloom.h \
@@ -220,6 +221,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/leveldb.h \
     src/threadsafety.h \
     src/limitedmap.h \
+    src/pooledmap.h \
     src/qt/macnotificationhandler.h \
     src/qt/splashscreen.h \
     src/qt/showi2paddresses.h \
@@ -255,6 +257,7 @@ SOURCES += src/qt/gostcoin.cpp \
     src/addrman.cpp \
     src/db.cpp \
     src/walletdb.cpp \
+    src/walletlog.cpp \
     src/qt/clientmodel.cpp \
     src/qt/guiutil.cpp \
     src/qt/transactionrecord.cpp \
@@ -21,6 +21,9 @@ namespace crypto
 		eGOSTR3410NumParamSets
 	};	
 	
+	struct GOSTR3410FixedCurve; // 256 bits CryptoPro-A without OpenSSL's BIGNUM
+	struct GOSTR3410AffinePoint;
+	struct GOSTR3410VerifyInput;
 	class GOSTR3410Curve
 	{
 		public:
@@ -33,21 +36,42 @@ namespace crypto
 			EC_POINT * MulP (const BIGNUM * n) const;
 			bool GetXY (const EC_POINT * p, BIGNUM * x, BIGNUM * y) const;
 			EC_POINT * CreatePoint (const BIGNUM * x, const BIGNUM * y) const;
-			void Sign (const BIGNUM * priv, const BIGNUM * digest, BIGNUM * r, BIGNUM * s);
+			bool Sign (const BIGNUM * priv, const BIGNUM * digest, BIGNUM * r, BIGNUM * s); // false if no nonce could be drawn
 			bool Verify (const EC_POINT * pub, const BIGNUM * digest, const BIGNUM * r, const BIGNUM * s);
+			// num signatures at once, results[i] is Verify for i-th, returns true if all are valid
+			bool VerifyBatch (size_t num, const EC_POINT * const * pub, const BIGNUM * const * digest,
+				const BIGNUM * const * r, const BIGNUM * const * s, bool * results);
 			EC_POINT * RecoverPublicKey (const BIGNUM * digest, const BIGNUM * r, const BIGNUM * s, bool isNegativeY = false) const;
 			
+		private:
+
+			EC_POINT * CreatePoint (const GOSTR3410AffinePoint& a) const;
+			bool GetVerifyInput (const EC_POINT * pub, const BIGNUM * digest, const BIGNUM * r, const BIGNUM * s, GOSTR3410VerifyInput& in) const;
+			bool RecoverPublicKeyFixed (const BIGNUM * digest, const BIGNUM * r, const BIGNUM * s, bool isNegativeY, EC_POINT *& Q) const;
+
 		private:
 
 			EC_GROUP * m_Group;
 			size_t m_KeyLen; // in bytes
+			std::unique_ptr<GOSTR3410FixedCurve> m_Fixed;
 	};
 
 	std::unique_ptr<GOSTR3410Curve>& GetGOSTR3410Curve (GOSTR3410ParamSet paramSet);
 
 // Big Endian
 	void GOSTR3411_2012_256 (const uint8_t * buf, size_t len, uint8_t * digest);
-	void GOSTR3411_2012_512 (const uint8_t * buf, size_t len, uint8_t * digest);	
+	void GOSTR3411_2012_512 (const uint8_t * buf, size_t len, uint8_t * digest);
+
+// Multi-buffer, 4 independent messages in lockstep, Big Endian
+	void GOSTR3411_2012_256_x4 (const uint8_t * const buf[4], const size_t len[4], uint8_t * const digest[4]);
+	void GOSTR3411_2012_512_x4 (const uint8_t * const buf[4], const size_t len[4], uint8_t * const digest[4]);
+
+// Block header, 256 (512 (header)) of 80 bytes header for nonces nonce..nonce+3 in the last 4 bytes
+	struct GOSTR3411_2012_HEADER_CTX;
+	GOSTR3411_2012_HEADER_CTX * GOSTR3411_2012_HEADER_CTX_new ();
+	void GOSTR3411_2012_HEADER_CTX_Init (GOSTR3411_2012_HEADER_CTX * ctx, const uint8_t * header);
+	void GOSTR3411_2012_HEADER_CTX_Hash_x4 (GOSTR3411_2012_HEADER_CTX * ctx, uint32_t nonce, uint8_t * const digest[4]);
+	void GOSTR3411_2012_HEADER_CTX_free (GOSTR3411_2012_HEADER_CTX * ctx);
 
 // Little Endian
 	struct GOSTR3411_2012_CTX;
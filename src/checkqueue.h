@@ -4,6 +4,7 @@
 #ifndef CHECKQUEUE_H
 #define CHECKQUEUE_H
 
+#include <boost/foreach.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
@@ -13,6 +14,16 @@
 
 template<typename T> class CCheckQueueControl;
 
+/** Run a batch of verifications, stopping at the first failure.
+  * Check types that are cheaper to verify together provide an overload.
+  */
+template<typename T> bool CheckBatch(std::vector<T> &vChecks) {
+    BOOST_FOREACH(T &check, vChecks)
+        if (!check())
+            return false;
+    return true;
+}
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -110,9 +121,8 @@ private:
                 fOk = fAllOk;
             }
             // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
+            if (fOk)
+                fOk = CheckBatch(vChecks);
             vChecks.clear();
         } while(true);
     }
@@ -209,14 +209,14 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive,
 void CDBEnv::CheckpointLSN(std::string strFile)
 {
     dbenv.txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || !setBerkeleyFile.count(strFile))
         return;
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), plog(NULL), activeTxn(NULL), activeBatch(NULL)
 {
     int ret;
     if (pszFile == NULL)
@@ -235,6 +235,27 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
         strFile = pszFile;
         ++bitdb.mapFileUseCount[strFile];
+
+        try {
+            plog = bitdb.OpenLog(strFile, fCreate);
+        }
+        catch (std::exception &e) {
+            --bitdb.mapFileUseCount[strFile];
+            strFile = "";
+            throw;
+        }
+        if (plog)
+        {
+            if (fCreate && !Exists(string("version")))
+            {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL)
         {
@@ -283,6 +304,13 @@ void CDB::Flush()
     if (activeTxn)
         return;
 
+    // A record log only needs the changes of this handle appended; it is synced by ThreadFlushWalletDB
+    if (plog)
+    {
+        plog->WritePending();
+        return;
+    }
+
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
     if (fReadOnly)
@@ -293,14 +321,18 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plog)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    if (activeBatch)
+        plog->TxnAbort(activeBatch);
+    activeBatch = NULL;
     pdb = NULL;
 
     Flush();
+    plog = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -312,6 +344,13 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        map<string, CWalletLog*>::iterator mi = mapLog.find(strFile);
+        if (mi != mapLog.end())
+        {
+            // Closing the log appends what is pending and syncs it
+            delete (*mi).second;
+            mapLog.erase(mi);
+        }
         if (mapDb[strFile] != NULL)
         {
             // Close the database handle
@@ -323,17 +362,60 @@ void CDBEnv::CloseDb(const string& strFile)
     }
 }
 
+CWalletLog *CDBEnv::OpenLog(const string& strFile, bool fCreate)
+{
+    map<string, CWalletLog*>::iterator mi = mapLog.find(strFile);
+    if (mi != mapLog.end())
+        return (*mi).second;
+    if (fMockDb || setBerkeleyFile.count(strFile))
+        return NULL;
+
+    filesystem::path pathFile = path / strFile;
+    bool fExists = filesystem::exists(pathFile);
+    if (fExists ? !CWalletLog::IsLogFile(pathFile) : !(fCreate && GetBoolArg("-walletlog")))
+    {
+        // Berkeley DB opens the file, or creates it if fCreate
+        if (fExists || fCreate)
+            setBerkeleyFile.insert(strFile);
+        return NULL;
+    }
+
+    CWalletLog *plog = new CWalletLog(pathFile);
+    if (!plog->Open())
+    {
+        delete plog;
+        throw runtime_error(strprintf("CDBEnv::OpenLog() : can't open record log %s", strFile.c_str()));
+    }
+    mapLog[strFile] = plog;
+    return plog;
+}
+
 bool CDBEnv::RemoveDb(const string& strFile)
 {
     this->CloseDb(strFile);
 
     LOCK(cs_db);
+    setBerkeleyFile.erase(strFile);
     int rc = dbenv.dbremove(NULL, strFile.c_str(), NULL, DB_AUTO_COMMIT);
     return (rc == 0);
 }
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    {
+        // A record log is rewritten in place, while it stays in use
+        LOCK(bitdb.cs_db);
+        if (bitdb.Open(GetDataDir()))
+        {
+            CWalletLog *plog = bitdb.OpenLog(strFile);
+            if (plog)
+            {
+                printf("Rewriting %s...\n", strFile.c_str());
+                return plog->Compact(pszSkip);
+            }
+        }
+    }
+
     while (true)
     {
         {
@@ -364,7 +446,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess)
                         {
@@ -436,20 +518,36 @@ void CDBEnv::Flush(bool fShutdown)
         return;
     {
         LOCK(cs_db);
+        // Sync the record logs; they are closed at shutdown, once no longer in use
+        for (map<string, CWalletLog*>::iterator it = mapLog.begin(); it != mapLog.end(); ++it)
+            (*it).second->Flush();
+
         map<string, int>::iterator mi = mapFileUseCount.begin();
         while (mi != mapFileUseCount.end())
         {
             string strFile = (*mi).first;
             int nRefCount = (*mi).second;
             printf("%s refcount=%d\n", strFile.c_str(), nRefCount);
-            if (nRefCount == 0)
+            if (nRefCount == 0 && mapLog.count(strFile))
+            {
+                // Keep a record log loaded until shutdown
+                if (fShutdown)
+                {
+                    CloseDb(strFile);
+                    printf("%s closed\n", strFile.c_str());
+                    mapFileUseCount.erase(mi++);
+                }
+                else
+                    mi++;
+            }
+            else if (nRefCount == 0)
             {
                 // Move log data to the dat file
                 CloseDb(strFile);
                 printf("%s checkpoint\n", strFile.c_str());
                 dbenv.txn_checkpoint(0, 0, 0);
                 printf("%s detach\n", strFile.c_str());
-                if (!fMockDb)
+                if (!fMockDb && setBerkeleyFile.count(strFile))
                     dbenv.lsn_reset(strFile.c_str(), 0);
                 printf("%s closed\n", strFile.c_str());
                 mapFileUseCount.erase(mi++);
@@ -6,8 +6,10 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "walletlog.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -42,6 +44,8 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CWalletLog*> mapLog;
+    std::set<std::string> setBerkeleyFile;  // files OpenLog found to be Berkeley databases
 
     CDBEnv();
     ~CDBEnv();
@@ -74,6 +78,16 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /*
+     * Record log backing strFile (see CWalletLog), opened on first use.
+     * Returns NULL if strFile is a Berkeley database, or does not exist
+     * and is not to be created as a log (fCreate and -walletlog).
+     * The backend of a file is decided once and remembered in mapLog or
+     * setBerkeleyFile, so the file header is only read on first use.
+     * Requires cs_db.
+     */
+    CWalletLog *OpenLog(const std::string& strFile, bool fCreate=false);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -87,13 +101,36 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Cursor over the records of a CDB in key order, on either storage backend */
+class CDBCursor
+{
+public:
+    Dbc* pcursor;
+    CWalletLog* plog;
+    CWalletLog::Data vchKey;  // last key read from the log
+    bool fStarted;
+
+    CDBCursor() : pcursor(NULL), plog(NULL), fStarted(false) {}
+
+    // Release the cursor, like Dbc::close()
+    void close()
+    {
+        if (pcursor)
+            pcursor->close();
+        delete this;
+    }
+};
+
+
+/** RAII class that provides access to a Berkeley database, or to a record log (CWalletLog) */
 class CDB
 {
 protected:
     Db* pdb;
+    CWalletLog* plog;
     std::string strFile;
     DbTxn *activeTxn;
+    CWalletLog::CBatch *activeBatch;
     bool fReadOnly;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
@@ -109,13 +146,30 @@ protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog)
+        {
+            CWalletLog::Data vchKey, vchValue;
+            ssKey.GetAndClear(vchKey);
+            if (!plog->Read(vchKey, vchValue))
+                return false;
+            try {
+                CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                ssValue.Swap(vchValue);
+                ssValue >> value;
+            }
+            catch (std::exception &e) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -144,7 +198,7 @@ protected:
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -153,12 +207,21 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (plog)
+        {
+            // the streams free their buffers zeroed, so key material is cleared as well
+            CWalletLog::Data vchKey, vchValue;
+            ssKey.GetAndClear(vchKey);
+            ssValue.GetAndClear(vchValue);
+            return plog->Write(vchKey, vchValue, fOverwrite, activeBatch);
+        }
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -173,7 +236,7 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -182,6 +245,13 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog)
+        {
+            CWalletLog::Data vchKey;
+            ssKey.GetAndClear(vchKey);
+            return plog->Erase(vchKey, activeBatch);
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -195,13 +265,20 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog)
+        {
+            CWalletLog::Data vchKey;
+            ssKey.GetAndClear(vchKey);
+            return plog->Exists(vchKey);
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -212,19 +289,54 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (plog)
+        {
+            CDBCursor* pcursor = new CDBCursor();
+            pcursor->plog = plog;
+            return pcursor;
+        }
         if (!pdb)
             return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        Dbc* pdbc = NULL;
+        int ret = pdb->cursor(NULL, &pdbc, 0);
         if (ret != 0)
             return NULL;
+        CDBCursor* pcursor = new CDBCursor();
+        pcursor->pcursor = pdbc;
         return pcursor;
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
+        if (pcursor->plog)
+        {
+            // Only the positioning used by the wallet: from a key on, and onwards
+            bool fInclusive;
+            if (fFlags == DB_SET_RANGE)
+            {
+                pcursor->vchKey.assign(ssKey.begin(), ssKey.end());
+                fInclusive = true;
+            }
+            else if (fFlags == DB_NEXT)
+                fInclusive = !pcursor->fStarted;
+            else
+                return EINVAL;
+            pcursor->fStarted = true;
+
+            CWalletLog::Data vchValue;
+            if (!pcursor->plog->Seek(pcursor->vchKey, fInclusive, pcursor->vchKey, vchValue))
+                return DB_NOTFOUND;
+
+            ssKey.SetType(SER_DISK);
+            ssKey.clear();
+            ssKey.write(&pcursor->vchKey[0], pcursor->vchKey.size());
+            ssValue.SetType(SER_DISK);
+            ssValue.Swap(vchValue);
+            return 0;
+        }
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
@@ -240,7 +352,7 @@ protected:
         }
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->pcursor->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -265,6 +377,13 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog)
+        {
+            if (activeBatch)
+                return false;
+            activeBatch = plog->TxnBegin();
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -276,6 +395,14 @@ public:
 
     bool TxnCommit()
     {
+        if (plog)
+        {
+            if (!activeBatch)
+                return false;
+            bool fOk = plog->TxnCommit(activeBatch);
+            activeBatch = NULL;
+            return fOk;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -285,6 +412,14 @@ public:
 
     bool TxnAbort()
     {
+        if (plog)
+        {
+            if (!activeBatch)
+                return false;
+            plog->TxnAbort(activeBatch);
+            activeBatch = NULL;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
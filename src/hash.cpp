@@ -1,5 +1,36 @@
 #include "hash.h"
 
+void HashBatch(size_t n, const unsigned char * const * ppch, const size_t * pnLen, uint256 * phash)
+{
+    static unsigned char pblank[1];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        const uint8_t * buf[4], * buf1[4];
+        size_t len[4], len1[4];
+        uint8_t hash1[4][64];
+        uint8_t * digest1[4], * digest2[4];
+        for (int j = 0; j < 4; j++)
+        {
+            buf[j] = pnLen[i+j] ? ppch[i+j] : pblank;
+            len[j] = pnLen[i+j];
+            digest1[j] = hash1[j];
+            buf1[j] = hash1[j];
+            len1[j] = 64;
+            digest2[j] = (uint8_t *)&phash[i+j];
+        }
+        i2p::crypto::GOSTR3411_2012_512_x4 (buf, len, digest1);
+        i2p::crypto::GOSTR3411_2012_256_x4 (buf1, len1, digest2);
+    }
+    // an idle lane costs as much as a busy one, so the remainder is cheaper one by one
+    for (; i < n; i++)
+    {
+        uint8_t hash1[64];
+        i2p::crypto::GOSTR3411_2012_512 (pnLen[i] ? ppch[i] : pblank, pnLen[i], hash1);
+        i2p::crypto::GOSTR3411_2012_256 (hash1, 64, (uint8_t *)&phash[i]);
+    }
+}
+
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
     return (x << r) | (x >> (32 - r));
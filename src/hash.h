@@ -34,29 +34,37 @@ inline uint256 Hash(const T1 pbegin, const T1 pend)
 class CHashWriter
 {
 private:
-    std::stringstream ctx;
+    // GOST 34.11 takes the message as a big endian number and compresses it from
+    // the last block backwards, so the object is collected in one contiguous
+    // buffer and hashed in place once it is complete
+    std::vector<char> vch;
 
 public:
     int nType;
     int nVersion;
 
     void Init() {
-        ctx.str("");
+        vch.clear();
     }
 
     CHashWriter(int nTypeIn, int nVersionIn) : nType(nTypeIn), nVersion(nVersionIn) {
         Init();
     }
 
+    void reserve(size_t n) {
+        vch.reserve(n);
+    }
+
     CHashWriter& write(const char *pch, size_t size) {
-		ctx.write (pch, size);
+        vch.insert(vch.end(), pch, pch + size);
         return (*this);
     }
 
     // invalidates the object
     uint256 GetHash() {
-		uint8_t hash1[64];
-    	i2p::crypto::GOSTR3411_2012_512 ((uint8_t *)ctx.str ().c_str (), ctx.str ().length (), hash1);
+        static unsigned char pblank[1];
+        uint8_t hash1[64];
+        i2p::crypto::GOSTR3411_2012_512 (vch.empty() ? pblank : (uint8_t *)&vch[0], vch.size(), hash1);
         uint256 hash2;
         i2p::crypto::GOSTR3411_2012_256 (hash1, 64, (unsigned char*)&hash2);
         return hash2;
@@ -95,6 +103,7 @@ template<typename T>
 uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
 {
     CHashWriter ss(nType, nVersion);
+    ss.reserve(::GetSerializeSize(obj, nType, nVersion));
     ss << obj;
     return ss.GetHash();
 }
@@ -115,6 +124,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+// GOST 34.11-256 (GOST 34.11-512 (...)) of n independent buffers, hashed four at a time in lockstep.
+// Digests are stored in the same byte order as CHashWriter::GetHash
+void HashBatch(size_t n, const unsigned char * const * ppch, const size_t * pnLen, uint256 * phash);
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
 #endif
@@ -102,7 +102,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
 
 void Shutdown()
 {
@@ -123,8 +122,10 @@ void Shutdown()
         LOCK(cs_main);
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-        if (pblocktree)
+        if (pblocktree) {
+            WriteBlockIndexSnapshot();
             pblocktree->Flush();
+        }
         if (pcoinsTip)
             pcoinsTip->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
@@ -328,6 +329,10 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -coinsdb<setting>=<n>  " + _("Tune the coins database: blockcache and writebuffer (in megabytes), blocksize (in kilobytes), compression (needs LevelDB built with Snappy), maxopenfiles, bloombits") + "\n" +
+        "  -blockdb<setting>=<n>  " + _("Tune the block index database, with the same settings as -coinsdb") + "\n" +
+        "  -sigcachemb=<n>        " + _("Set signature cache size in megabytes (default: 16)") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Size the signature cache for at most <n> entries instead") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -341,6 +346,7 @@ std::string HelpMessage()
         "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (IPv4, IPv6 or I2P") + "\n" +
         "  -discover              " + _("Discover own IP address (default: 1 when listening and no -externalip)") + "\n" +
         "  -checkpoints           " + _("Only accept block chain matching built-in checkpoints (default: 1)") + "\n" +
+        "  -headersfirst          " + _("Fetch headers first and the blocks from all peers during initial sync (default: 1)") + "\n" +
         "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n" +
         "  -bind=<addr>           " + _("Bind to given address and always listen on it. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 1 unless -connect)") + "\n" +
@@ -386,14 +392,18 @@ std::string HelpMessage()
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -keypoolmin=<n>        " + _("Refill the key pool in the background when it holds fewer than <n> keys (default: half the key pool size)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
+        "  -walletlog             " + _("Create a new wallet.dat as an append-only record log instead of a Berkeley DB file (default: 0)") + "\n" +
+        "  -migratewallet         " + _("Convert a Berkeley DB wallet.dat to an append-only record log on startup") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -msgthreads=<n>        " + _("Set the number of network message handler threads (up to 8, 0 = auto, default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -616,17 +626,27 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 200);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    if (!InitSocketPoll())
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
     if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
         nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
+#ifndef WIN32
+    // spare descriptors let the coins database keep more of its files open,
+    // it reopens them constantly during the initial download otherwise
+    int nSpareFD = nFD - MIN_CORE_FILEDESCRIPTORS - nMaxConnections;
+    if (nSpareFD > 0)
+        SoftSetArg("-coinsdbmaxopenfiles", itostr(std::min(64 + nSpareFD, 1000)));
+#endif
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = GetBoolArg("-debug");
     fBenchmark = GetBoolArg("-benchmark");
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", 0);
@@ -637,6 +657,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nMessageHandlerThreads = GetArg("-msgthreads", 0);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = boost::thread::hardware_concurrency();
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -772,14 +797,17 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
-        if (GetBoolArg("-salvagewallet"))
+        // A record log checks itself when loaded, and drops a damaged end
+        bool fWalletLog = CWalletLog::IsLogFile(GetDataDir() / "wallet.dat");
+
+        if (GetBoolArg("-salvagewallet") && !fWalletLog)
         {
             // Recover readable keypairs:
             if (!CWalletDB::Recover(bitdb, "wallet.dat", true))
                 return false;
         }
 
-        if (filesystem::exists(GetDataDir() / "wallet.dat"))
+        if (filesystem::exists(GetDataDir() / "wallet.dat") && !fWalletLog)
         {
             CDBEnv::VerifyResult r = bitdb.Verify("wallet.dat", CWalletDB::Recover);
             if (r == CDBEnv::RECOVER_OK)
@@ -792,6 +820,13 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
             if (r == CDBEnv::RECOVER_FAIL)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
+
+            if (GetBoolArg("-migratewallet"))
+            {
+                uiInterface.InitMessage(_("Migrating wallet..."));
+                if (!CWalletDB::Migrate(bitdb, "wallet.dat"))
+                    return InitError(_("Error converting wallet.dat to a record log"));
+            }
         }
     } // (!fDisableWallet)
 
@@ -948,7 +983,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest bounds the memory of the coins cache
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1046,7 +1081,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1228,6 +1263,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Run a thread to refill the key pool, and have it top up the pool now
+        threadGroup.create_thread(boost::bind(&CWallet::ThreadKeyPoolRefill, pwalletMain));
+        pwalletMain->RequestKeyPoolRefill();
     }
 
     return !fRequestShutdown;
@@ -17,24 +17,16 @@ namespace {
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
 {
     int ok = 0;
-    BN_CTX *ctx = NULL;
     EC_POINT *pub_key = NULL;
 
     if (!eckey) return 0;
 
-    const EC_GROUP *group = EC_KEY_get0_group(eckey);
-
-    if ((ctx = BN_CTX_new()) == NULL)
-        goto err;
-
-    pub_key = EC_POINT_new(group);
+    // same group as the key, the curve multiplies by the generator in constant time
+    pub_key = i2p::crypto::GetGOSTR3410Curve (i2p::crypto::eGOSTR3410CryptoProA)->MulP(priv_key);
 
     if (pub_key == NULL)
         goto err;
 
-    if (!EC_POINT_mul(group, pub_key, priv_key, NULL, NULL, ctx))
-        goto err;
-
     EC_KEY_set_private_key(eckey,priv_key);
     EC_KEY_set_public_key(eckey,pub_key);
 
@@ -44,8 +36,6 @@ err:
 
     if (pub_key)
         EC_POINT_free(pub_key);
-    if (ctx != NULL)
-        BN_CTX_free(ctx);
 
     return(ok);
 }
@@ -144,7 +134,12 @@ public:
 		const BIGNUM * priv = EC_KEY_get0_private_key(pkey);
 		BIGNUM * d = BN_bin2bn (hash.begin (), 32, nullptr); 
 		ECDSA_SIG *sig = ECDSA_SIG_new ();	
-		i2p::crypto::GetGOSTR3410Curve (i2p::crypto::eGOSTR3410CryptoProA)->Sign (priv, d, sig->r, sig->s);
+		if (!i2p::crypto::GetGOSTR3410Curve (i2p::crypto::eGOSTR3410CryptoProA)->Sign (priv, d, sig->r, sig->s))
+		{
+			BN_free (d);
+			ECDSA_SIG_free(sig);
+			return false;
+		}
 		// encode signature is in DER format		
 		auto nSize = ECDSA_size (pkey); // max size
 		vchSig.resize(nSize);
@@ -176,10 +171,12 @@ public:
         ECDSA_SIG *sig = ECDSA_SIG_new ();
 		const BIGNUM * priv = EC_KEY_get0_private_key(pkey);
 		BIGNUM * d = BN_bin2bn (hash.begin (), 32, nullptr);
-		i2p::crypto::GetGOSTR3410Curve (i2p::crypto::eGOSTR3410CryptoProA)->Sign (priv, d, sig->r, sig->s);
+		bool fSigned = i2p::crypto::GetGOSTR3410Curve (i2p::crypto::eGOSTR3410CryptoProA)->Sign (priv, d, sig->r, sig->s);
 		BN_free (d);
-        if (sig==NULL)
+        if (!fSigned) {
+            ECDSA_SIG_free(sig);
             return false;
+        }
         memset(p64, 0, 64);
         int nBitsR = BN_num_bits(sig->r);
         int nBitsS = BN_num_bits(sig->s);
@@ -318,6 +315,54 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     return true;
 }
 
+bool CPubKey::VerifyBatch(const std::vector<CPubKey> &vPubKey, const std::vector<uint256> &vHash,
+                          const std::vector<std::vector<unsigned char> > &vSig, std::vector<bool> &vfValid) {
+    assert(vPubKey.size() == vHash.size() && vPubKey.size() == vSig.size());
+    const auto& curve = i2p::crypto::GetGOSTR3410Curve (i2p::crypto::eGOSTR3410CryptoProA);
+    const EC_GROUP *group = curve->GetGroup();
+    vfValid.assign(vPubKey.size(), false);
+
+    // decode everything first, entries that don't decode are invalid
+    std::vector<size_t> vIndex;
+    std::vector<EC_POINT*> vpub;
+    std::vector<BIGNUM*> vd, vr, vs;
+    std::vector<ECDSA_SIG*> vsig;
+    for (size_t i = 0; i < vPubKey.size(); i++) {
+        if (!vPubKey[i].IsValid() || vSig[i].empty())
+            continue;
+        EC_POINT *pub = EC_POINT_new(group);
+        if (!EC_POINT_oct2point(group, pub, vPubKey[i].begin(), vPubKey[i].size(), NULL)) {
+            EC_POINT_free(pub);
+            continue;
+        }
+        const unsigned char *p = &vSig[i][0];
+        ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &p, vSig[i].size());
+        if (sig == NULL) {
+            EC_POINT_free(pub);
+            continue;
+        }
+        vIndex.push_back(i);
+        vpub.push_back(pub);
+        vd.push_back(BN_bin2bn(vHash[i].begin(), 32, NULL));
+        vr.push_back(sig->r);
+        vs.push_back(sig->s);
+        vsig.push_back(sig);
+    }
+
+    bool fAllValid = vIndex.size() == vPubKey.size();
+    if (!vIndex.empty()) {
+        std::unique_ptr<bool[]> results(new bool[vIndex.size()]);
+        fAllValid &= curve->VerifyBatch(vIndex.size(), &vpub[0], &vd[0], &vr[0], &vs[0], results.get());
+        for (size_t j = 0; j < vIndex.size(); j++) {
+            vfValid[vIndex[j]] = results[j];
+            EC_POINT_free(vpub[j]);
+            BN_free(vd[j]);
+            ECDSA_SIG_free(vsig[j]);
+        }
+    }
+    return fAllValid;
+}
+
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
@@ -152,6 +152,11 @@ public:
     // If this public key is not fully valid, the return value will be false.
     bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
 
+    // Verify several DER signatures at once, sharing work between them.
+    // vfValid[i] is set to vPubKey[i].Verify(vHash[i], vSig[i]); returns true if all are valid.
+    static bool VerifyBatch(const std::vector<CPubKey> &vPubKey, const std::vector<uint256> &vHash,
+                            const std::vector<std::vector<unsigned char> > &vSig, std::vector<bool> &vfValid);
+
     // Verify a compact signature (~65 bytes).
     // See CKey::SignCompact.
     bool VerifyCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
@@ -24,23 +24,47 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize) {
+CLevelDBProfile::CLevelDBProfile(const std::string &strNameIn, size_t nCacheSize) : strName(strNameIn) {
+    std::string strPrefix = "-" + strName;
+    nBlockCache = mapArgs.count(strPrefix + "blockcache") ? (size_t)GetArg(strPrefix + "blockcache", 0) << 20 : nCacheSize / 2;
+    // up to two write buffers may be held in memory simultaneously
+    nWriteBuffer = mapArgs.count(strPrefix + "writebuffer") ? (size_t)GetArg(strPrefix + "writebuffer", 0) << 20 : nCacheSize / 4;
+    nBlockSize = GetArg(strPrefix + "blocksize", 4) << 10;
+    fCompression = GetBoolArg(strPrefix + "compression", false);
+    nMaxOpenFiles = GetArg(strPrefix + "maxopenfiles", 64);
+    nBloomBits = GetArg(strPrefix + "bloombits", 10);
+
+    // keep what LevelDB would otherwise clamp or reject within sane bounds
+    nBlockCache = std::max(nBlockCache, (size_t)(1 << 20));
+    nWriteBuffer = std::max(nWriteBuffer, (size_t)(64 << 10));
+    nBlockSize = std::max(std::min(nBlockSize, (size_t)(4 << 20)), (size_t)(1 << 10));
+    nMaxOpenFiles = std::max(nMaxOpenFiles, 20);
+    nBloomBits = std::max(std::min(nBloomBits, 32), 0);
+}
+
+std::string CLevelDBProfile::ToString() const {
+    return strprintf("%s: blockcache=%" PRIszu "KiB writebuffer=%" PRIszu "KiB blocksize=%" PRIszu "KiB compression=%d maxopenfiles=%d bloombits=%d",
+        strName.c_str(), nBlockCache >> 10, nWriteBuffer >> 10, nBlockSize >> 10, fCompression, nMaxOpenFiles, nBloomBits);
+}
+
+static leveldb::Options GetOptions(const CLevelDBProfile &profile) {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.block_cache = leveldb::NewLRUCache(profile.nBlockCache);
+    options.write_buffer_size = profile.nWriteBuffer;
+    options.block_size = profile.nBlockSize;
+    options.filter_policy = profile.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
+    options.compression = profile.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = profile.nMaxOpenFiles;
     return options;
 }
 
-CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) {
+CLevelDB::CLevelDB(const boost::filesystem::path &path, const CLevelDBProfile &profileIn, bool fMemory, bool fWipe) : profile(profileIn) {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -51,7 +75,7 @@ CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool
             leveldb::DestroyDB(path.string(), options);
         }
         boost::filesystem::create_directory(path);
-        printf("Opening LevelDB in %s\n", path.string().c_str());
+        printf("Opening LevelDB in %s (%s)\n", path.string().c_str(), profile.ToString().c_str());
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     if (!status.ok())
@@ -70,6 +94,28 @@ CLevelDB::~CLevelDB() {
     options.env = NULL;
 }
 
+std::string CLevelDB::GetProperty(const std::string &strProperty) {
+    std::string strValue;
+    if (!pdb->GetProperty(strProperty, &strValue))
+        return "";
+    return strValue;
+}
+
+uint64 CLevelDB::GetApproximateSize(char chPrefix) {
+    // keys start with their type character, so its range is [chPrefix, chPrefix+1)
+    std::string strBegin, strEnd;
+    if (chPrefix == 0) {
+        strEnd = std::string(1, (char)0xff);
+    } else {
+        strBegin = std::string(1, chPrefix);
+        strEnd = std::string(1, (char)(chPrefix + 1));
+    }
+    leveldb::Range range(strBegin, strEnd);
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
 bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error) {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     if (!status.ok()) {
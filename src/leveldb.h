@@ -19,6 +19,24 @@ public:
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error);
 
+/** Storage settings of one database. Each can be overridden with an option
+ *  named after the database, e.g. -coinsdbmaxopenfiles for the coins database. */
+class CLevelDBProfile
+{
+public:
+    std::string strName;
+    size_t nBlockCache;   // -<name>blockcache, MiB (default: half of its cache share)
+    size_t nWriteBuffer;  // -<name>writebuffer, MiB (default: a quarter of its cache share)
+    size_t nBlockSize;    // -<name>blocksize, KiB (default: 4)
+    bool fCompression;    // -<name>compression, Snappy (default: off)
+    int nMaxOpenFiles;    // -<name>maxopenfiles (default: 64)
+    int nBloomBits;       // -<name>bloombits, 0 disables the filter (default: 10)
+
+    CLevelDBProfile(const std::string &strNameIn, size_t nCacheSize);
+
+    std::string ToString() const;
+};
+
 // Batch of changes queued to be written to a CLevelDB
 class CLevelDBBatch
 {
@@ -76,10 +94,21 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    // the settings it was opened with
+    CLevelDBProfile profile;
+
 public:
-    CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDB(const boost::filesystem::path &path, const CLevelDBProfile &profileIn, bool fMemory = false, bool fWipe = false);
     ~CLevelDB();
 
+    const CLevelDBProfile &GetProfile() const { return profile; }
+
+    // a LevelDB property like "leveldb.stats", empty if unknown
+    std::string GetProperty(const std::string &strProperty);
+
+    // estimated bytes on disk used by keys starting with chPrefix, or by all keys if chPrefix is 0
+    uint64 GetApproximateSize(char chPrefix = 0);
+
     template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
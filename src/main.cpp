@@ -13,6 +13,8 @@
 #include "checkqueue.h"
 #include "Gost.h" // i2pd
 #include <boost/algorithm/string/replace.hpp>
+#include <atomic>
+#include <memory>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
@@ -31,7 +33,40 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+
+// The entries of mapBlockIndex are never freed one by one, so they are carved
+// out of large chunks rather than allocated separately
+class CBlockIndexArena
+{
+private:
+    enum { CHUNK_SIZE = 4096 };
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed; // entries handed out from the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* New()
+    {
+        if (nUsed == CHUNK_SIZE) {
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    void Clear()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = CHUNK_SIZE;
+    }
+};
+static CBlockIndexArena blockIndexArena;
+
 uint256 hashGenesisBlock("0x00000dd00df9728558f339d2e034e2c862329d509018b56d699aec5b6fa6ba1f");
 static CBigNum bnProofOfWorkLimit( CBigNum().SetCompact(0x1e0ffff0) );
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -40,6 +75,7 @@ uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+static vector<CBlockIndex*> vChainActive; // pindexBest and its ancestors by height
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
@@ -47,7 +83,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 200000;
@@ -59,6 +95,19 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Headers-first sync: validated headers of the best known chain ahead of the block index,
+// as header only CBlockIndex objects outside of mapBlockIndex; vHeaderChain[0]->pprev is in it
+bool fHeadersFirst = true;
+BlockMap mapHeaderIndex;
+deque<CBlockIndex*> vHeaderChain;
+
+struct CBlockInFlight
+{
+    int64 nNodeId; // a CNode may come back at the address of one that is gone
+    int64 nTime;
+};
+map<uint256, CBlockInFlight> mapBlocksInFlight;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -173,8 +222,9 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
+bool CCoinsView::UpdateStats(const CCoinsStats &delta) { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
@@ -184,48 +234,148 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
+bool CCoinsViewBacked::UpdateStats(const CCoinsStats &delta) { return base->UpdateStats(delta); }
+
+uint256 CCoinsStats::GetOutputHash(const uint256 &txid, unsigned int n, const CCoins &coins, const CTxOut &out) {
+    // SHA256 rather than the GOST based Hash(): this runs for every output a block creates or spends.
+    // All fields but the script have a fixed size, so the encoding is unambiguous.
+    unsigned char vchHeader[17];
+    int64 nValue = out.nValue;
+    for (int i = 0; i < 4; i++) {
+        vchHeader[i] = (n >> (8 * i)) & 0xff;
+        vchHeader[4 + i] = ((unsigned int)coins.nHeight >> (8 * i)) & 0xff;
+    }
+    vchHeader[8] = coins.fCoinBase ? 1 : 0;
+    for (int i = 0; i < 8; i++)
+        vchHeader[9 + i] = ((uint64)nValue >> (8 * i)) & 0xff;
+
+    uint256 hash;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, txid.begin(), 32);
+    SHA256_Update(&ctx, vchHeader, sizeof(vchHeader));
+    if (!out.scriptPubKey.empty())
+        SHA256_Update(&ctx, &out.scriptPubKey[0], out.scriptPubKey.size());
+    SHA256_Final((unsigned char*)&hash, &ctx);
+    return hash;
+}
+
+void CCoinsStats::AddOutput(const uint256 &txid, unsigned int n, const CCoins &coins, const CTxOut &out) {
+    nTransactionOutputs++;
+    nTotalAmount += out.nValue;
+    hashSet += GetOutputHash(txid, n, coins, out);
+}
+
+void CCoinsStats::RemoveOutput(const uint256 &txid, unsigned int n, const CCoins &coins, const CTxOut &out) {
+    nTransactionOutputs--;
+    nTotalAmount -= out.nValue;
+    hashSet -= GetOutputHash(txid, n, coins, out);
+}
+
+void CCoinsStats::AddCoins(const CCoins &coins) {
+    if (coins.IsPruned())
+        return;
+    nTransactions++;
+    nSerializedSize += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+}
+
+void CCoinsStats::RemoveCoins(const CCoins &coins) {
+    if (coins.IsPruned())
+        return;
+    nTransactions--;
+    nSerializedSize -= 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+}
+
+CCoinsStats &CCoinsStats::operator+=(const CCoinsStats &delta) {
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nSerializedSize += delta.nSerializedSize;
+    hashSet += delta.hashSet;
+    nTotalAmount += delta.nTotalAmount;
+    return *this;
+}
+
+CCoinsKeyHasher::CCoinsKeyHasher() {
+    uint256 salt = GetRandHash();
+    k0 = salt.Get64(0);
+    k1 = salt.Get64(1);
+    k2 = salt.Get64(2);
+    k3 = salt.Get64(3);
+}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0) { }
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
-    }
-    return false;
+    CCoinsMap::value_type *it = FetchCoins(txid);
+    if (it == NULL)
+        return false;
+    coins = it->second.coins;
+    return true;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::value_type *CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::value_type *it = cacheCoins.find(txid);
+    if (it != NULL)
         return it;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
-        return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
-    return ret;
+        return NULL;
+    it = cacheCoins.insert(txid).first;
+    tmp.swap(it->second.coins);
+    // the parent only knows it as spent, so nothing needs to be erased there later
+    if (it->second.coins.IsPruned())
+        it->second.flags = CCoinsCacheEntry::FRESH;
+    cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
+    return it;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
-    assert(it != cacheCoins.end());
-    return it->second;
+    CCoinsMap::value_type *it = FetchCoins(txid);
+    assert(it != NULL);
+    CCoinsCacheEntry &entry = it->second;
+    // the caller may change the coins, account for their memory when it is needed next
+    if (!(entry.flags & CCoinsCacheEntry::PENDING)) {
+        cachedCoinsUsage -= entry.coins.DynamicMemoryUsage();
+        entry.flags |= CCoinsCacheEntry::PENDING;
+        vPending.push_back(&entry);
+    }
+    entry.flags |= CCoinsCacheEntry::DIRTY;
+    return entry.coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::value_type *it = FetchCoins(txid);
+    assert(it != NULL);
+    return it->second.coins;
+}
+
+void CCoinsViewCache::SetEntry(CCoinsCacheEntry &entry, const CCoins &coins) {
+    bool fAccounted = !(entry.flags & CCoinsCacheEntry::PENDING);
+    if (fAccounted)
+        cachedCoinsUsage -= entry.coins.DynamicMemoryUsage();
+    entry.coins = coins;
+    entry.flags |= CCoinsCacheEntry::DIRTY;
+    if (fAccounted)
+        cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    SetEntry(cacheCoins.insert(txid).first->second, coins);
+    return true;
+}
+
+bool CCoinsViewCache::SetNewCoins(const uint256 &txid, const CCoins &coins) {
+    std::pair<CCoinsMap::value_type*, bool> ret = cacheCoins.insert(txid);
+    if (ret.second)
+        ret.first->second.flags = CCoinsCacheEntry::FRESH;
+    SetEntry(ret.first->second, coins);
     return true;
 }
 
 bool CCoinsViewCache::HaveCoins(const uint256 &txid) {
-    return FetchCoins(txid) != cacheCoins.end();
+    return FetchCoins(txid) != NULL;
 }
 
 CBlockIndex *CCoinsViewCache::GetBestBlock() {
@@ -239,17 +389,62 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    AccountPending();
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        CCoinsCacheEntry &child = it->second;
+        if (!(child.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoinsMap::value_type *itUs = cacheCoins.find(it->first);
+        if (itUs == NULL) {
+            // created and spent in the child, neither we nor our parent ever saw it
+            if ((child.flags & CCoinsCacheEntry::FRESH) && child.coins.IsPruned())
+                continue;
+            CCoinsCacheEntry &entry = cacheCoins.insert(it->first).first->second;
+            entry.coins.swap(child.coins);
+            entry.flags = CCoinsCacheEntry::DIRTY | (child.flags & CCoinsCacheEntry::FRESH);
+            cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+        } else {
+            CCoinsCacheEntry &entry = itUs->second;
+            cachedCoinsUsage -= entry.coins.DynamicMemoryUsage();
+            if ((entry.flags & CCoinsCacheEntry::FRESH) && child.coins.IsPruned()) {
+                cacheCoins.erase(it->first);
+            } else {
+                entry.coins.swap(child.coins);
+                entry.flags |= CCoinsCacheEntry::DIRTY;
+                cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+            }
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
+bool CCoinsViewCache::GetStats(CCoinsStats &stats) {
+    if (!base->GetStats(stats))
+        return false;
+    stats += statsDelta;
+    CBlockIndex *pindex = GetBestBlock();
+    stats.nHeight = pindex ? pindex->nHeight : 0;
+    stats.hashBlock = pindex ? pindex->GetBlockHash() : uint256(0);
+    return true;
+}
+
+bool CCoinsViewCache::UpdateStats(const CCoinsStats &delta) {
+    statsDelta += delta;
+    return true;
+}
+
 bool CCoinsViewCache::Flush() {
+    AccountPending();
+    // the base keeps the change until it has written the coins that go with it
+    base->UpdateStats(statsDelta);
+    statsDelta = CCoinsStats();
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
@@ -257,6 +452,19 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    AccountPending();
+    return cacheCoins.memory_usage() + cachedCoinsUsage + vPending.capacity() * sizeof(CCoinsCacheEntry*);
+}
+
+void CCoinsViewCache::AccountPending() {
+    BOOST_FOREACH(CCoinsCacheEntry *pentry, vPending) {
+        cachedCoinsUsage += pentry->coins.DynamicMemoryUsage();
+        pentry->flags &= ~CCoinsCacheEntry::PENDING;
+    }
+    vPending.clear();
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -278,6 +486,7 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -527,7 +736,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -903,7 +1112,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1032,22 +1241,110 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vChainActive.size())
+        return NULL;
+    return vChainActive[nHeight];
+}
+
+CBlockIndex* FindBlockByTime(int64 nTime)
+{
+    // The median time past never decreases along the chain. Block times may lag the
+    // real time, allow for the same two hours they may run ahead of it.
+    nTime -= 2 * 60 * 60;
+    int nLow = 0, nHigh = vChainActive.size();
+    while (nLow < nHigh) {
+        int nMid = nLow + (nHigh - nLow) / 2;
+        if (vChainActive[nMid]->GetMedianTimePast() < nTime)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid;
+    }
+    // the block before the first one that passed may hold them too
+    return FindBlockByHeight(std::max(nLow - 1, 0));
+}
+
+// Make pindex the end of vChainActive, only its part past the fork is rewritten
+void static SetChainActiveTip(CBlockIndex* pindex)
+{
+    if (pindex == NULL) {
+        vChainActive.clear();
+        return;
+    }
+    vChainActive.resize(pindex->nHeight + 1);
+    while (pindex && vChainActive[pindex->nHeight] != pindex) {
+        vChainActive[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+// The last block pindex has in common with the main chain, found by bisecting
+// the heights rather than walking back
+static CBlockIndex* FindForkInMainChain(CBlockIndex* pindex)
+{
+    if (vChainActive.empty() || pindex->GetAncestor(0) != vChainActive[0])
+        return NULL;
+    int nLow = 0;
+    int nHigh = std::min(pindex->nHeight, (int)vChainActive.size() - 1);
+    while (nLow < nHigh) {
+        int nMid = (nLow + nHigh + 1) / 2;
+        if (pindex->GetAncestor(nMid) == vChainActive[nMid])
+            nLow = nMid;
+        else
+            nHigh = nMid - 1;
+    }
+    return vChainActive[nLow];
+}
+
+// Turn the lowest '1' bit in the binary representation of a number into a '0'.
+int static inline InvertLowestOne(int n) { return n & (n - 1); }
+
+// Compute what height to jump back to with the CBlockIndex::pskip pointer.
+int static inline GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression seems to perform well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 &&
+                                       heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
@@ -1236,10 +1533,8 @@ unsigned int static OldGetNextWorkRequired(const CBlockIndex* pindexLast, const
         blockstogoback = nInterval;
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
     blockstogoback = fNewDifficultyProtocol2 ? (newTargetTimespan/205) : blockstogoback;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->nHeight >= blockstogoback ? pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback) : NULL;
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1368,7 +1663,7 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
     }
 }
 
-bool ConnectBestBlock(CValidationState &state) {
+bool ConnectBestBlock(CValidationState &state, CBlock *pblock, CBlockIndex *pindexBlock) {
     do {
         CBlockIndex *pindexNewBest;
 
@@ -1407,7 +1702,7 @@ bool ConnectBestBlock(CValidationState &state) {
                 BOOST_FOREACH(CBlockIndex *pindexSwitch, vAttach) {
                     boost::this_thread::interruption_point();
                     try {
-                        if (!SetBestChain(state, pindexSwitch))
+                        if (!SetBestChain(state, pindexSwitch, pindexSwitch == pindexBlock ? pblock : NULL))
                             return false;
                     } catch(std::runtime_error &e) {
                         return state.Abort(_("System error: ") + e.what());
@@ -1441,7 +1736,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1486,7 +1781,7 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
     }
 
     // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    assert(inputs.SetNewCoins(txhash, CCoins(*this, nHeight)));
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1502,7 +1797,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1512,11 +1807,30 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighashcache.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
 
+bool CheckBatch(std::vector<CScriptCheck> &vChecks)
+{
+    if (vChecks.size() < 2)
+        return CheckBatch<CScriptCheck>(vChecks);
+
+    // evaluate with signatures deferred, then re-evaluate only what could have been wrong
+    std::vector<bool> vfOk(vChecks.size());
+    CSignatureBatch batch;
+    for (unsigned int i = 0; i < vChecks.size(); i++) {
+        batch.SetTag(i);
+        vfOk[i] = vChecks[i]();
+    }
+    batch.Verify(vfOk);
+    for (unsigned int i = 0; i < vChecks.size(); i++)
+        if (!vfOk[i] && !vChecks[i]())
+            return false;
+    return true;
+}
+
 bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
 {
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
@@ -1542,7 +1856,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1576,12 +1890,17 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // the inputs of a wide transaction share the serialized parts of their signature hashes
+            std::shared_ptr<const CSignatureHashCache> psighashcache;
+            if (vin.size() > 1)
+                psighashcache.reset(new CSignatureHashCache(*this));
+
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, *this, i, flags, 0);
+                CScriptCheck check(coins, *this, i, flags, 0, psighashcache);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1605,6 +1924,66 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
 
 
 
+/** Collects the change that connecting or disconnecting a block makes to the statistics of
+ *  the unspent output set. Outputs are accounted one by one as they are spent and created.
+ *  The record of a touched transaction is accounted once before its first and once after
+ *  its last modification, so its serialized size is not recomputed on every spend. */
+class CCoinsStatsUpdate
+{
+private:
+    CCoinsViewCache &view;
+    std::set<uint256> setTouched;
+    CCoinsStats delta;
+
+public:
+    CCoinsStatsUpdate(CCoinsViewCache &viewIn) : view(viewIn) { }
+
+    // call before txid is modified; fNew if the view has no unspent outputs for it
+    void Touch(const uint256 &txid, bool fNew = false) {
+        if (!setTouched.insert(txid).second || fNew)
+            return;
+        if (view.HaveCoins(txid))
+            delta.RemoveCoins(view.AccessCoins(txid));
+    }
+
+    // call before the inputs of tx are spent
+    void SpendInputs(const CTransaction &tx) {
+        if (tx.IsCoinBase())
+            return;
+        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+            Touch(txin.prevout.hash);
+            const CCoins &coins = view.AccessCoins(txin.prevout.hash);
+            delta.RemoveOutput(txin.prevout.hash, txin.prevout.n, coins, coins.vout[txin.prevout.n]);
+        }
+    }
+
+    // call after the outputs of txid were added, or before they are removed
+    void AddOutputs(const uint256 &txid, bool fRemove = false) {
+        const CCoins &coins = view.AccessCoins(txid);
+        for (unsigned int n = 0; n < coins.vout.size(); n++) {
+            if (coins.vout[n].IsNull())
+                continue;
+            if (fRemove)
+                delta.RemoveOutput(txid, n, coins, coins.vout[n]);
+            else
+                delta.AddOutput(txid, n, coins, coins.vout[n]);
+        }
+    }
+
+    // call after output out was restored into coins
+    void RestoreOutput(const COutPoint &out, const CCoins &coins) {
+        delta.AddOutput(out.hash, out.n, coins, coins.vout[out.n]);
+    }
+
+    // account for the final state of the touched records and hand the change to the view
+    void Apply() {
+        BOOST_FOREACH(const uint256 &txid, setTouched)
+            if (view.HaveCoins(txid))
+                delta.AddCoins(view.AccessCoins(txid));
+        view.UpdateStats(delta);
+    }
+};
+
 bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean)
 {
     assert(pindex == view.GetBestBlock());
@@ -1624,10 +2003,13 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     if (blockUndo.vtxundo.size() + 1 != vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    CCoinsStatsUpdate statsUpdate(view);
+
     // undo transactions in reverse order
     for (int i = vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = vtx[i];
         uint256 hash = tx.GetHash();
+        statsUpdate.Touch(hash);
 
         // check that all outputs are available
         if (!view.HaveCoins(hash)) {
@@ -1646,6 +2028,7 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
             fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
 
         // remove outputs
+        statsUpdate.AddOutputs(hash, true);
         outs = CCoins();
 
         // restore inputs
@@ -1657,6 +2040,7 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
                 const COutPoint &out = tx.vin[j].prevout;
                 const CTxInUndo &undo = txundo.vprevout[j];
                 CCoins coins;
+                statsUpdate.Touch(out.hash);
                 view.GetCoins(out.hash, coins); // this can fail if the prevout was already entirely spent
                 if (undo.nHeight != 0) {
                     // undo data contains height: this is the last output of the prevout tx being spent
@@ -1677,9 +2061,11 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
                 coins.vout[out.n] = undo.txout;
                 if (!view.SetCoins(out.hash, coins))
                     return error("DisconnectBlock() : cannot restore coin inputs");
+                statsUpdate.RestoreOutput(out, coins);
             }
         }
     }
+    statsUpdate.Apply();
 
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev);
@@ -1759,7 +2145,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -1772,8 +2158,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
                          (fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE);
 
     CBlockUndo blockundo;
+    CCoinsStatsUpdate statsUpdate(view);
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // without script check threads, the whole block is checked as one batch at the end
+    std::vector<CScriptCheck> vBlockChecks;
 
     int64 nStart = GetTimeMicros();
     int64 nFees = 0;
@@ -1819,13 +2208,20 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             nFees += nTxValueIn-nTxValueOut;
 
             std::vector<CScriptCheck> vChecks;
-            if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
+            if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : &vBlockChecks))
                 return false;
             control.Add(vChecks);
         }
 
+        if (!fJustCheck) {
+            statsUpdate.SpendInputs(tx);
+            statsUpdate.Touch(GetTxHash(i), true);
+        }
+
         CTxUndo txundo;
         tx.UpdateCoins(state, view, txundo, pindex->nHeight, GetTxHash(i));
+        if (!fJustCheck)
+            statsUpdate.AddOutputs(GetTxHash(i));
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
@@ -1846,7 +2242,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return state.DoS(100, error("ConnectBlock() : coinbase pays too much (actual=%" PRI64d " vs limit=%" PRI64d ")", vtx[0].GetValueOut(), GetBlockValue(pindex->nHeight, nFees)));
 
-    if (!control.Wait())
+    if (!control.Wait() || !CheckBatch(vBlockChecks))
         return state.DoS(100, false);
     int64 nTime2 = GetTimeMicros() - nStart;
     if (fBenchmark)
@@ -1881,6 +2277,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    statsUpdate.Apply();
+
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
@@ -1891,7 +2289,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     return true;
 }
 
-bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
+bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew, CBlock *pblockNew)
 {
     // All modifications to the coin state will be done in this cache.
     // Only when all have succeeded, we push it to pcoinsTip.
@@ -1899,18 +2297,23 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Find the fork (typically, there is none)
     CBlockIndex* pfork = view.GetBestBlock();
-    CBlockIndex* plonger = pindexNew;
-    while (pfork && pfork != plonger)
+    if (pfork && pfork == pindexBest)
+        pfork = FindForkInMainChain(pindexNew);
+    else if (pfork)
     {
-        while (plonger->nHeight > pfork->nHeight) {
+        CBlockIndex* plonger = pindexNew;
+        if (plonger->nHeight > pfork->nHeight)
+            plonger = plonger->GetAncestor(pfork->nHeight);
+        else if (pfork->nHeight > plonger->nHeight)
+            pfork = pfork->GetAncestor(plonger->nHeight);
+        while (pfork != plonger)
+        {
+            pfork = pfork->pprev;
             plonger = plonger->pprev;
-            assert(plonger != NULL);
+            assert(pfork != NULL && plonger != NULL);
         }
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
-        assert(pfork != NULL);
     }
+    assert(pfork != NULL || view.GetBestBlock() == NULL);
 
     // List of what to disconnect (typically nothing)
     vector<CBlockIndex*> vDisconnect;
@@ -1951,9 +2354,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // Connect longer branch
     vector<CTransaction> vDelete;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        CBlock blockRead;
+        if (!(pindex == pindexNew && pblockNew) && !blockRead.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
+        CBlock &block = (pindex == pindexNew && pblockNew) ? *pblockNew : blockRead;
         int64 nStart = GetTimeMicros();
         if (!block.ConnectBlock(state, pindex, view)) {
             if (state.IsInvalid()) {
@@ -1980,7 +2384,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2006,6 +2410,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    SetChainActiveTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect) {
@@ -2031,7 +2436,6 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = pindexNew->GetBlockHash();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
@@ -2079,15 +2483,16 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndex* pindexNew = blockIndexArena.New();
+    *pindexNew = CBlockIndex(*this);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->nTx = vtx.size();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
@@ -2102,7 +2507,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Abort(_("Failed to write block index"));
 
     // New best?
-    if (!ConnectBestBlock(state))
+    if (!ConnectBestBlock(state, this, pindexNew))
         return false;
 
     if (pindexNew == pindexBest)
@@ -2221,6 +2626,11 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    // Already done for this very block, e.g. by the import pipeline or before it was connected
+    uint256 hash = (fCheckPOW && fCheckMerkleRoot) ? GetHash() : uint256(0);
+    if (hash != 0 && hash == hashChecked)
+        return true;
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"));
@@ -2244,7 +2654,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     }
 
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(GetHash(), nBits))
+    if (fCheckPOW && !CheckProofOfWork(hash != 0 ? hash : GetHash(), nBits))
         return state.DoS(50, error("CheckBlock() : proof of work failed"));
 
     // Check timestamp
@@ -2289,6 +2699,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
+    hashChecked = hash;
     return true;
 }
 
@@ -2303,7 +2714,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != hashGenesisBlock) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"));
         pindexPrev = (*mi).second;
@@ -2327,7 +2738,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
             return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight));
 
         // Don't accept any forks from the main chain prior to last checkpoint
-        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
         if (pcheckpoint && nHeight < pcheckpoint->nHeight)
             return state.DoS(100, error("AcceptBlock() : forked chain older than last checkpoint (height %d)", nHeight));
 
@@ -2379,7 +2790,10 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
             if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+            {
                 pnode->PushInventory(CInv(MSG_BLOCK, hash));
+                ScheduleMessageHandler(pnode);
+            }
     }
 
     return true;
@@ -2399,6 +2813,257 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+// Headers-first sync
+//
+// During the initial block download the sync node is asked for headers instead of
+// block inventory. The headers are checked like AcceptBlock does, minus the
+// transactions, and kept in vHeaderChain. The blocks of the first BLOCK_DOWNLOAD_WINDOW
+// headers are then requested from every peer that has them, at most
+// MAX_BLOCKS_IN_TRANSIT_PER_PEER at a time each. Blocks arriving ahead of their parent
+// wait in mapOrphanBlocks as usual. A header leaves vHeaderChain once its block is in
+// mapBlockIndex.
+
+bool static CheckBlockHeader(CValidationState &state, const CBlockHeader &header, const uint256 &hash, CBlockIndex *pindexPrev)
+{
+    if (!CheckProofOfWork(hash, header.nBits))
+        return state.DoS(50, error("CheckBlockHeader() : proof of work failed"));
+
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlockHeader() : block timestamp too far in the future"));
+
+    int nHeight = pindexPrev->nHeight + 1;
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return state.DoS(100, error("CheckBlockHeader() : incorrect proof of work"));
+
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("CheckBlockHeader() : block's timestamp is too early"));
+
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("CheckBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return state.DoS(100, error("CheckBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+
+    return true;
+}
+
+void static EraseHeaders(const vector<CBlockIndex*> &vErase)
+{
+    BOOST_FOREACH(CBlockIndex* pindex, vErase) {
+        uint256 hash = pindex->GetBlockHash();
+        delete pindex;
+        mapHeaderIndex.erase(hash);
+    }
+}
+
+void static TruncateHeaderChain(deque<CBlockIndex*>::iterator it)
+{
+    vector<CBlockIndex*> vErase(it, vHeaderChain.end());
+    vHeaderChain.erase(it, vHeaderChain.end());
+    EraseHeaders(vErase);
+}
+
+// the block of a header turned out to be invalid, so are the headers built on it
+void static InvalidBlockHeaderFound(const uint256 &hash)
+{
+    BlockMap::iterator mi = mapHeaderIndex.find(hash);
+    if (mi == mapHeaderIndex.end())
+        return;
+    printf("InvalidBlockHeaderFound: dropping headers from height %d\n", mi->second->nHeight);
+    TruncateHeaderChain(find(vHeaderChain.begin(), vHeaderChain.end(), mi->second));
+}
+
+// Attach a batch of headers, either extending vHeaderChain or replacing a part of it
+// if the batch alone brings the branch more work.
+bool static ProcessBlockHeaders(CValidationState &state, const vector<CBlock> &vHeaders)
+{
+    vector<CBlockIndex*> vNew;
+    CBlockIndex *pindexFork = NULL;
+    CBlockIndex *pindexPrev = NULL;
+    BOOST_FOREACH(const CBlockHeader &header, vHeaders) {
+        uint256 hash = header.GetHash();
+        if (pindexPrev == NULL) {
+            // skip what we have, then find where the rest attaches
+            if (mapBlockIndex.count(hash) || mapHeaderIndex.count(hash))
+                continue;
+            BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+            if (mi == mapBlockIndex.end()) {
+                mi = mapHeaderIndex.find(header.hashPrevBlock);
+                if (mi == mapHeaderIndex.end())
+                    return error("ProcessBlockHeaders() : headers do not connect");
+            }
+            pindexFork = pindexPrev = mi->second;
+        } else if (header.hashPrevBlock != pindexPrev->GetBlockHash()) {
+            EraseHeaders(vNew);
+            return state.DoS(20, error("ProcessBlockHeaders() : non-continuous headers sequence"));
+        }
+
+        if (!CheckBlockHeader(state, header, hash, pindexPrev)) {
+            EraseHeaders(vNew);
+            return error("ProcessBlockHeaders() : CheckBlockHeader FAILED");
+        }
+
+        CBlockHeader headerNew = header;
+        CBlockIndex* pindexNew = new CBlockIndex(headerNew);
+        pindexNew->phashBlock = &(mapHeaderIndex.insert(make_pair(hash, pindexNew)).first->first);
+        pindexNew->pprev = pindexPrev;
+        pindexNew->nHeight = pindexPrev->nHeight + 1;
+        pindexNew->BuildSkip();
+        pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork().getuint256();
+        pindexNew->nStatus = BLOCK_VALID_TREE;
+        vNew.push_back(pindexNew);
+        pindexPrev = pindexNew;
+    }
+    if (vNew.empty())
+        return true;
+
+    CBlockIndex *pindexBestHeader = vHeaderChain.empty() ? pindexBest : vHeaderChain.back();
+    if (pindexFork != pindexBestHeader) {
+        // a competing branch is only taken when this batch alone outweighs ours
+        if (vNew.back()->nChainWork <= pindexBestHeader->nChainWork) {
+            EraseHeaders(vNew);
+            return true;
+        }
+        // keep our headers up to the fork, none if it leaves from the block index
+        deque<CBlockIndex*>::iterator it = find(vHeaderChain.begin(), vHeaderChain.end(), pindexFork);
+        TruncateHeaderChain(it == vHeaderChain.end() ? vHeaderChain.begin() : it + 1);
+    }
+    vHeaderChain.insert(vHeaderChain.end(), vNew.begin(), vNew.end());
+    printf("ProcessBlockHeaders: %" PRIszu " new headers, best header height=%d\n", vNew.size(), vHeaderChain.back()->nHeight);
+    return true;
+}
+
+// move the headers whose blocks got into the block index out of vHeaderChain
+void PruneHeaderChain()
+{
+    vector<CBlockIndex*> vErase;
+    while (!vHeaderChain.empty()) {
+        BlockMap::iterator mi = mapBlockIndex.find(vHeaderChain.front()->GetBlockHash());
+        if (mi == mapBlockIndex.end())
+            break;
+        vErase.push_back(vHeaderChain.front());
+        vHeaderChain.pop_front();
+        if (!vHeaderChain.empty())
+            vHeaderChain.front()->pprev = mi->second;
+    }
+    if (vErase.empty())
+        return;
+    // skip pointers into the pruned headers are rebuilt in chain order, so that
+    // every walk only passes the block index and the headers already relinked
+    int nHeightFirst = vErase.front()->nHeight, nHeightLast = vErase.back()->nHeight;
+    BOOST_FOREACH(CBlockIndex* pindex, vHeaderChain)
+        if (pindex->pskip != NULL && pindex->pskip->nHeight >= nHeightFirst && pindex->pskip->nHeight <= nHeightLast)
+            pindex->BuildSkip();
+    EraseHeaders(vErase);
+}
+
+void static MarkBlockAsReceived(const uint256 &hash, CNode *pfrom)
+{
+    map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    // a block from somebody else is dropped from the owner's set when it is checked next
+    if (it->second.nNodeId == pfrom->nId)
+        pfrom->setBlocksInFlight.erase(hash);
+    mapBlocksInFlight.erase(it);
+
+    // the other requests queue behind this one on the peer's link, their time starts now
+    int64 nNow = GetTime();
+    BOOST_FOREACH(const uint256 &hashInFlight, pfrom->setBlocksInFlight) {
+        map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hashInFlight);
+        if (mi != mapBlocksInFlight.end() && mi->second.nNodeId == pfrom->nId)
+            mi->second.nTime = nNow;
+    }
+}
+
+// Ask the sync node for the headers after the best one we know
+void static RequestHeaders(CNode *pto)
+{
+    int64 nNow = GetTime();
+    if (pto->nHeadersRequestTime != 0) {
+        if (nNow - pto->nHeadersRequestTime > HEADERS_DOWNLOAD_TIMEOUT) {
+            printf("RequestHeaders() : %s did not send headers in time, disconnecting\n", pto->addrName.c_str());
+            pto->fSyncHeaders = false;
+            pto->fDisconnect = true;
+            ReleaseSyncNode(pto);
+        }
+        return;
+    }
+    // let the blocks catch up first
+    if (vHeaderChain.size() >= MAX_HEADERS_AHEAD)
+        return;
+    CBlockIndex *pindexBestHeader = vHeaderChain.empty() ? pindexBest : vHeaderChain.back();
+    pto->PushMessage("getheaders", CBlockLocator(pindexBestHeader), uint256(0));
+    pto->nHeadersRequestTime = nNow;
+}
+
+// Fill pto's free download slots with the first blocks of the header chain nobody is fetching
+void static RequestBlocks(CNode *pto, vector<CInv> &vGetData)
+{
+    int64 nNow = GetTime();
+
+    // requests of peers that are gone are free again
+    static int64 nLastPurge;
+    if (nNow - nLastPurge >= 10) {
+        nLastPurge = nNow;
+        set<int64> setLive;
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (!pnode->fDisconnect)
+                    setLive.insert(pnode->nId);
+        }
+        for (map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); ) {
+            if (setLive.count(it->second.nNodeId))
+                it++;
+            else
+                mapBlocksInFlight.erase(it++);
+        }
+    }
+
+    if (pto->fClient || !pto->fSuccessfullyConnected || pto->fDisconnect || nNow < pto->nBlockDownloadBackoff ||
+        (pto->nVersion >= NOBLKS_VERSION_START && pto->nVersion < NOBLKS_VERSION_END))
+        return;
+
+    // a peer that sits on a block for too long has all its requests given to others for a while
+    bool fStalling = false;
+    for (set<uint256>::iterator it = pto->setBlocksInFlight.begin(); it != pto->setBlocksInFlight.end(); ) {
+        map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(*it);
+        if (mi == mapBlocksInFlight.end() || mi->second.nNodeId != pto->nId) {
+            pto->setBlocksInFlight.erase(it++);
+            continue;
+        }
+        if (nNow - mi->second.nTime > BLOCK_DOWNLOAD_TIMEOUT)
+            fStalling = true;
+        it++;
+    }
+    if (fStalling) {
+        printf("RequestBlocks() : %s stalled, releasing %" PRIszu " blocks\n", pto->addrName.c_str(), pto->setBlocksInFlight.size());
+        BOOST_FOREACH(const uint256 &hash, pto->setBlocksInFlight)
+            mapBlocksInFlight.erase(hash);
+        pto->setBlocksInFlight.clear();
+        pto->nBlockDownloadBackoff = nNow + BLOCK_DOWNLOAD_TIMEOUT;
+        return;
+    }
+
+    unsigned int nWindow = std::min((unsigned int)vHeaderChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = 0; i < nWindow && pto->setBlocksInFlight.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++) {
+        CBlockIndex *pindex = vHeaderChain[i];
+        if (pindex->nHeight > pto->nStartingHeight)
+            break;
+        uint256 hash = pindex->GetBlockHash();
+        if (mapBlocksInFlight.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        CBlockInFlight inflight;
+        inflight.nNodeId = pto->nId;
+        inflight.nTime = nNow;
+        mapBlocksInFlight.insert(make_pair(hash, inflight));
+        pto->setBlocksInFlight.insert(hash);
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
 {
     // Check for duplicate
@@ -2412,7 +3077,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (!pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -2443,8 +3108,9 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            // Ask this guy to fill in what we're missing, unless its parents are being downloaded
+            if (!mapHeaderIndex.count(hash))
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
         }
         return true;
     }
@@ -2473,6 +3139,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
     }
+    PruneHeaderChain();
 
     printf("ProcessBlock: ACCEPTED\n");
     return true;
@@ -2692,50 +3359,337 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
     return OpenDiskFile(pos, "rev", fReadOnly);
 }
 
+// Block files mapped for serving blocks to peers, with the time they were last used.
+// Address space is cheap on 64 bit systems, the pages themselves are page cache anyway.
+static const unsigned int MAX_MAPPED_BLOCKFILES = sizeof(void*) > 4 ? 32 : 2;
+static CCriticalSection cs_mapBlockFileMapped;
+static map<int, pair<std::shared_ptr<const CMappedFile>, int64> > mapBlockFileMapped;
+// Hashing a block for the message checksum costs about as much as parsing it
+static limitedmap<uint64, unsigned int> mapRawBlockChecksum(10000);
+
+bool ReadRawBlockFromDisk(const CDiskBlockPos &pos, CRawBlock &block)
+{
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+
+    uint64 nKey = ((uint64)pos.nFile << 32) | pos.nPos;
+    bool fHaveChecksum = false;
+    {
+        LOCK(cs_mapBlockFileMapped);
+        pair<std::shared_ptr<const CMappedFile>, int64> &entry = mapBlockFileMapped[pos.nFile];
+        for (int nTry = 0; ; nTry++)
+        {
+            // Each block is preceded by the message start and its size, see CBlock::WriteToDisk
+            const CMappedFile *pfile = entry.first.get();
+            if (pfile && pfile->size() >= pos.nPos)
+            {
+                const char *pchHeader = pfile->data() + pos.nPos - 8;
+                unsigned int nSize = 0;
+                memcpy(&nSize, pchHeader + 4, sizeof(nSize));
+                if (memcmp(pchHeader, pchMessageStart, sizeof(pchMessageStart)) != 0 || nSize > MAX_BLOCK_SIZE)
+                    return error("ReadRawBlockFromDisk() : no block at %u in blk%05u.dat", pos.nPos, pos.nFile);
+                if (pfile->size() - pos.nPos >= nSize)
+                {
+                    block.pfile = entry.first;
+                    block.pch = pfile->data() + pos.nPos;
+                    block.nSize = nSize;
+                    break;
+                }
+            }
+            // Not mapped yet, or the block was appended after the mapping was made
+            if (nTry > 0)
+            {
+                mapBlockFileMapped.erase(pos.nFile);
+                return false;
+            }
+            std::shared_ptr<CMappedFile> pfileNew(new CMappedFile());
+            if (!pfileNew->Open(GetDataDir() / "blocks" / strprintf("blk%05u.dat", pos.nFile)))
+            {
+                mapBlockFileMapped.erase(pos.nFile);
+                return false;
+            }
+            entry.first = pfileNew;
+        }
+        entry.second = GetTimeMillis();
+
+        if (mapBlockFileMapped.size() > MAX_MAPPED_BLOCKFILES)
+        {
+            // Blocks still queued for sending keep their mapping alive
+            map<int, pair<std::shared_ptr<const CMappedFile>, int64> >::iterator itOldest = mapBlockFileMapped.begin();
+            for (map<int, pair<std::shared_ptr<const CMappedFile>, int64> >::iterator it = mapBlockFileMapped.begin(); it != mapBlockFileMapped.end(); it++)
+                if (it->second.second < itOldest->second.second)
+                    itOldest = it;
+            mapBlockFileMapped.erase(itOldest);
+        }
+
+        limitedmap<uint64, unsigned int>::const_iterator it = mapRawBlockChecksum.find(nKey);
+        if (it != mapRawBlockChecksum.end())
+        {
+            block.nChecksum = it->second;
+            fHaveChecksum = true;
+        }
+    }
+
+    if (!fHaveChecksum)
+    {
+        uint256 hash = Hash(block.pch, block.pch + block.nSize);
+        memcpy(&block.nChecksum, &hash, sizeof(block.nChecksum));
+        LOCK(cs_mapBlockFileMapped);
+        mapRawBlockChecksum.insert(make_pair(nKey, block.nChecksum));
+    }
+    return true;
+}
+
 CBlockIndex * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(hash, (CBlockIndex*)NULL));
+    if (!ret.second)
+        return (*ret.first).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    CBlockIndex* pindexNew = blockIndexArena.New();
+    (*ret.first).second = pindexNew;
+    pindexNew->phashBlock = &((*ret.first).first);
 
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+// Block index snapshot (blocks/index.snapshot), written at shutdown so the next start
+// neither walks the block tree database nor hashes every header again: a header
+// followed by one fixed-size record per block index entry in height order, which
+// refers to its predecessor by position. It is only trusted while the block tree
+// database holds its token; the first block index write after loading erases it.
+static const char pchSnapshotMagic[4] = { 'g', 'b', 'i', 's' };
+
+struct CBlockIndexSnapshotHeader
 {
-    if (!pblocktree->LoadBlockIndexGuts())
-        return false;
+    char pchMagic[4];
+    unsigned int nRecordSize;
+    unsigned int nRecords;
+    uint256 token;
+};
 
-    boost::this_thread::interruption_point();
+struct CBlockIndexSnapshotRecord
+{
+    uint256 hash;
+    uint256 hashMerkleRoot;
+    uint256 nChainWork;
+    int64 nMoneySupply;
+    int nPrev; // position of pprev, -1 if none
+    int nHeight;
+    int nFile;
+    unsigned int nDataPos;
+    unsigned int nUndoPos;
+    unsigned int nTx;
+    unsigned int nChainTx;
+    unsigned int nStatus;
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+};
+
+// whether mapBlockIndex holds the whole block tree, only then can it be snapshot
+static bool fBlockIndexLoaded = false;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
+
+bool static LoadBlockIndexSnapshot()
+{
+    uint256 token;
+    if (!pblocktree->ReadSnapshotToken(token))
+        return false;
+
+    // map it where possible, read it otherwise
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    CMappedFile mapped;
+    std::vector<char> vchFile;
+    const char *pch = NULL;
+    size_t nSize = 0;
+    if (mapped.Open(path)) {
+        pch = mapped.data();
+        nSize = mapped.size();
+    } else {
+        FILE *file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return false;
+        vchFile.resize(GetFilesize(file));
+        if (!vchFile.empty() && fread(&vchFile[0], 1, vchFile.size(), file) != vchFile.size())
+            vchFile.clear();
+        fclose(file);
+        pch = vchFile.empty() ? NULL : &vchFile[0];
+        nSize = vchFile.size();
+    }
+
+    CBlockIndexSnapshotHeader header;
+    if (nSize < sizeof(header))
+        return error("LoadBlockIndexSnapshot() : snapshot truncated");
+    memcpy(&header, pch, sizeof(header));
+    if (memcmp(header.pchMagic, pchSnapshotMagic, sizeof(pchSnapshotMagic)) != 0 ||
+        header.nRecordSize != sizeof(CBlockIndexSnapshotRecord) ||
+        nSize != sizeof(header) + (size_t)header.nRecords * sizeof(CBlockIndexSnapshotRecord))
+        return error("LoadBlockIndexSnapshot() : snapshot has a different format");
+    if (header.token != token)
+        return false;
+
+    vector<CBlockIndex*> vIndex(header.nRecords);
+    mapBlockIndex.reserve(header.nRecords);
+    for (unsigned int i = 0; i < header.nRecords; i++)
+    {
+        CBlockIndexSnapshotRecord rec;
+        memcpy(&rec, pch + sizeof(header) + (size_t)i * sizeof(rec), sizeof(rec));
+        if (rec.nPrev < -1 || rec.nPrev >= (int)i) {
+            UnloadBlockIndex();
+            return error("LoadBlockIndexSnapshot() : entry %u out of order", i);
+        }
+
+        CBlockIndex* pindexNew = blockIndexArena.New();
+        pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(rec.hash, pindexNew));
+        if (!ret.second) {
+            UnloadBlockIndex();
+            return error("LoadBlockIndexSnapshot() : duplicate entry %s", rec.hash.ToString().c_str());
+        }
+        pindexNew->phashBlock     = &((*ret.first).first);
+        pindexNew->pprev          = rec.nPrev < 0 ? NULL : vIndex[rec.nPrev];
+        pindexNew->nMoneySupply   = rec.nMoneySupply;
+        pindexNew->nHeight        = rec.nHeight;
+        pindexNew->nFile          = rec.nFile;
+        pindexNew->nDataPos       = rec.nDataPos;
+        pindexNew->nUndoPos       = rec.nUndoPos;
+        pindexNew->nChainWork     = rec.nChainWork;
+        pindexNew->nTx            = rec.nTx;
+        pindexNew->nChainTx       = rec.nChainTx;
+        pindexNew->nStatus        = rec.nStatus;
+        pindexNew->nVersion       = rec.nVersion;
+        pindexNew->hashMerkleRoot = rec.hashMerkleRoot;
+        pindexNew->nTime          = rec.nTime;
+        pindexNew->nBits          = rec.nBits;
+        pindexNew->nNonce         = rec.nNonce;
+        pindexNew->BuildSkip();
+        vIndex[i] = pindexNew;
+
+        if (pindexGenesisBlock == NULL && rec.hash == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+        if ((pindexNew->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindexNew->nStatus & BLOCK_FAILED_MASK))
+            setBlockIndexValid.insert(pindexNew);
+    }
+    return true;
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    if (!fBlockIndexLoaded || (pblocktree->HaveSnapshotToken() && boost::filesystem::exists(path)))
+        return true;
 
-    // Calculate nChainWork
+    int64 nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    CBlockIndexSnapshotHeader header;
+    memcpy(header.pchMagic, pchSnapshotMagic, sizeof(pchSnapshotMagic));
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    header.nRecords = vSortedByHeight.size();
+    header.token = GetRandHash();
+
+    boost::filesystem::path pathTmp = path;
+    pathTmp.replace_extension(".new");
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : cannot open %s", pathTmp.string().c_str());
+    bool fOk = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    map<const CBlockIndex*, int> mapPos;
+    for (unsigned int i = 0; fOk && i < vSortedByHeight.size(); i++)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        const CBlockIndex* pindex = vSortedByHeight[i].second;
+        CBlockIndexSnapshotRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.hash           = pindex->GetBlockHash();
+        rec.hashMerkleRoot = pindex->hashMerkleRoot;
+        rec.nChainWork     = pindex->nChainWork;
+        rec.nMoneySupply   = pindex->nMoneySupply;
+        rec.nPrev          = -1;
+        rec.nHeight        = pindex->nHeight;
+        rec.nFile          = pindex->nFile;
+        rec.nDataPos       = pindex->nDataPos;
+        rec.nUndoPos       = pindex->nUndoPos;
+        rec.nTx            = pindex->nTx;
+        rec.nChainTx       = pindex->nChainTx;
+        rec.nStatus        = pindex->nStatus;
+        rec.nVersion       = pindex->nVersion;
+        rec.nTime          = pindex->nTime;
+        rec.nBits          = pindex->nBits;
+        rec.nNonce         = pindex->nNonce;
+        if (pindex->pprev) {
+            map<const CBlockIndex*, int>::const_iterator it = mapPos.find(pindex->pprev);
+            if (it == mapPos.end()) {
+                fOk = false;
+                break;
+            }
+            rec.nPrev = it->second;
+        }
+        mapPos[pindex] = i;
+        fOk = fwrite(&rec, sizeof(rec), 1, file) == 1;
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : failed to write %s", path.string().c_str());
+    }
+    if (!pblocktree->WriteSnapshotToken(header.token))
+        return error("WriteBlockIndexSnapshot() : failed to store token");
+    printf("Wrote block index snapshot of %u entries  %15" PRI64d "ms\n", header.nRecords, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool static LoadBlockIndexDB()
+{
+    int64 nStart = GetTimeMillis();
+    if (LoadBlockIndexSnapshot())
+        printf("LoadBlockIndexDB(): loaded %u entries from the block index snapshot  %15" PRI64d "ms\n",
+            (unsigned int)mapBlockIndex.size(), GetTimeMillis() - nStart);
+    else
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
-            setBlockIndexValid.insert(pindex);
+        if (!pblocktree->LoadBlockIndexGuts())
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        // Calculate nChainWork
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->BuildSkip();
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindex);
+        }
+        printf("LoadBlockIndexDB(): loaded %u entries from the block tree database  %15" PRI64d "ms\n",
+            (unsigned int)mapBlockIndex.size(), GetTimeMillis() - nStart);
     }
+    fBlockIndexLoaded = true;
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -2772,6 +3726,7 @@ bool static LoadBlockIndexDB()
          pindexPrev->pnext = pindex;
          pindex = pindexPrev;
     }
+    SetChainActiveTip(pindexBest);
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -2818,7 +3773,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() <= 2 * nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2854,7 +3809,9 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
 
 void UnloadBlockIndex()
 {
+    fBlockIndexLoaded = false;
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
     nBestHeight = 0;
@@ -2862,6 +3819,7 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    vChainActive.clear();
 }
 
 bool LoadBlockIndex()
@@ -2983,7 +3941,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3049,73 +4007,191 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+/** Import pipeline for LoadExternalBlockFile. A reader thread locates and deserializes the
+ *  blocks of the file, a pool of threads runs the context-free CheckBlock (proof of work,
+ *  transactions, merkle root) on many of them at once, and the calling thread hands them
+ *  to ProcessBlock in file order, which finds them checked already. Blocks stay in a
+ *  window of bounded size from reading to processing, so the reader cannot run away. */
+class CBlockImporter
 {
-    int64 nStart = GetTimeMillis();
-
-    int nLoaded = 0;
-    try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64 nStartByte = 0;
-        if (dbp) {
-            // (try to) skip already indexed part
-            CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-                nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
+private:
+    struct CEntry
+    {
+        CBlock block;
+        uint64 nBlockPos;
+        bool fChecked;
+    };
+
+    FILE *fileIn;
+    uint64 nStartByte;
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;    // there is room in the window
+    boost::condition_variable condCheck;   // there are blocks to check
+    boost::condition_variable condProcess; // the oldest block in the window is checked
+    std::deque<CEntry*> queueWindow;       // all blocks in flight, in file order
+    std::deque<CEntry*> queueCheck;        // blocks no checker has taken yet
+    bool fReadDone;
+
+    static const unsigned int MAX_WINDOW = 64;
+
+    void Push(CEntry *pentry) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queueWindow.size() >= MAX_WINDOW)
+            condRead.wait(lock);
+        queueWindow.push_back(pentry);
+        queueCheck.push_back(pentry);
+        condCheck.notify_one();
+    }
+
+    void ThreadRead() {
+        RenameThread("gostcoin-loadread");
+        try {
+            CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+            if (nStartByte)
+                blkdat.Seek(nStartByte);
+            uint64 nRewind = blkdat.GetPos();
+            while (blkdat.good() && !blkdat.eof()) {
+                boost::this_thread::interruption_point();
+
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[4];
+                    blkdat.FindByte(pchMessageStart[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, pchMessageStart, 4))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (std::exception &e) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read block
+                    uint64 nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    std::unique_ptr<CEntry> pentry(new CEntry());
+                    blkdat >> pentry->block;
+                    nRewind = blkdat.GetPos();
+                    if (nBlockPos >= nStartByte) {
+                        pentry->nBlockPos = nBlockPos;
+                        pentry->fChecked = false;
+                        Push(pentry.release());
+                    }
+                } catch (std::exception &e) {
+                    printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+                }
             }
+        } catch (std::runtime_error &e) {
+            AbortNode(_("Error: system error: ") + e.what());
         }
-        uint64 nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
-            boost::this_thread::interruption_point();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        condProcess.notify_all();
+    }
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[4];
-                blkdat.FindByte(pchMessageStart[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, pchMessageStart, 4))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
-                break;
+    void ThreadCheck() {
+        RenameThread("gostcoin-loadchk");
+        while (true) {
+            CEntry *pentry;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueCheck.empty())
+                    condCheck.wait(lock);
+                pentry = queueCheck.front();
+                queueCheck.pop_front();
             }
-            try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                }
-            } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            // failures are reported again when ProcessBlock repeats the check
+            CValidationState state;
+            pentry->block.CheckBlock(state);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pentry->fChecked = true;
+                if (pentry == queueWindow.front())
+                    condProcess.notify_one();
             }
         }
+    }
+
+    // the next block in file order, once it is checked; NULL at the end of the file
+    CEntry *Pop() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(queueWindow.empty() ? fReadDone : queueWindow.front()->fChecked))
+            condProcess.wait(lock);
+        if (queueWindow.empty())
+            return NULL;
+        CEntry *pentry = queueWindow.front();
+        queueWindow.pop_front();
+        condRead.notify_one();
+        return pentry;
+    }
+
+public:
+    CBlockImporter(FILE *fileInIn, uint64 nStartByteIn) : fileIn(fileInIn), nStartByte(nStartByteIn), fReadDone(false) { }
+
+    ~CBlockImporter() {
+        BOOST_FOREACH(CEntry *pentry, queueWindow)
+            delete pentry;
+    }
+
+    int Run(CDiskBlockPos *dbp) {
+        int nLoaded = 0;
+        boost::thread_group threadGroup;
+        CThreadGroupStopper stopper(threadGroup); // before the importer goes, whatever ends the import
+        threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+        int nCheckThreads = std::max(1, (int)boost::thread::hardware_concurrency() - 1);
+        for (int i = 0; i < nCheckThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+        while (true) {
+            std::unique_ptr<CEntry> pentry(Pop());
+            if (pentry.get() == NULL)
+                break;
+
+            LOCK(cs_main);
+            if (dbp)
+                dbp->nPos = pentry->nBlockPos;
+            CValidationState state;
+            if (ProcessBlock(state, NULL, &pentry->block, dbp))
+                nLoaded++;
+            if (state.IsError())
+                break;
+        }
+        return nLoaded;
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64 nStart = GetTimeMillis();
+
+    uint64 nStartByte = 0;
+    if (dbp) {
+        // (try to) skip already indexed part
+        CBlockFileInfo info;
+        if (pblocktree->ReadBlockFileInfo(dbp->nFile, info))
+            nStartByte = info.nSize;
+    }
+
+    int nLoaded = 0;
+    try {
+        CBlockImporter importer(fileIn, nStartByte);
+        nLoaded = importer.Run(dbp);
+    } catch (boost::thread_interrupted) {
         fclose(fileIn);
-    } catch(std::runtime_error &e) {
+        throw;
+    } catch (std::exception &e) {
         AbortNode(_("Error: system error: ") + e.what());
     }
+    fclose(fileIn);
     if (nLoaded > 0)
         printf("Loaded %i blocks from external file in %" PRI64d "ms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -3230,6 +4306,33 @@ bool static AlreadyHave(const CInv& inv)
 unsigned char pchMessageStart[4] = { 0xfa, 0xca, 0xba, 0xda };
 
 
+// Where blocks cannot be served from the mapped block files, the last one read
+// is kept serialized, so the peers asking for a new block all share one copy
+static CCriticalSection cs_blockPayload;
+static uint256 hashBlockPayload;
+static CNetPayloadRef pBlockPayload;
+
+static CNetPayloadRef GetBlockPayload(const CBlockIndex* pindex)
+{
+    {
+        LOCK(cs_blockPayload);
+        if (pBlockPayload && hashBlockPayload == pindex->GetBlockHash())
+            return pBlockPayload;
+    }
+    CBlock block;
+    bool fRead = block.ReadFromDisk(pindex);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(block.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+    ss << block;
+    CNetPayloadRef payload(new CNetPayload(ss));
+    if (!fRead)
+        return payload;
+    LOCK(cs_blockPayload);
+    hashBlockPayload = pindex->GetBlockHash();
+    pBlockPayload = payload;
+    return payload;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3254,34 +4357,47 @@ void static ProcessGetData(CNode* pfrom)
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
+                // Only the lookup needs cs_main, block index entries and what
+                // is on disk for them do not change once they are there
                 bool send = true;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                pfrom->nBlocksRequested++;
-                if (mi != mapBlockIndex.end())
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
                 {
-                    // If the requested block is at a height below our last
-                    // checkpoint, only serve it if it's in the checkpointed chain
-                    int nHeight = ((*mi).second)->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-                    if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
-                       if (!((*mi).second)->IsInMainChain())
-                       {
-                         printf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
-                         send = false;
-                       }
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        pindex = (*mi).second;
+                        // If the requested block is at a height below our last
+                        // checkpoint, only serve it if it's in the checkpointed chain
+                        int nHeight = pindex->nHeight;
+                        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+                        if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
+                           if (!pindex->IsInMainChain())
+                           {
+                             printf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                             send = false;
+                           }
+                        }
+                    } else {
+                        send = false;
                     }
-                } else {
-                    send = false;
+                    hashBest = hashBestChain;
                 }
+                pfrom->nBlocksRequested++;
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // Send block from disk, full blocks straight from the
+                    // mapped block file without parsing or copying them
+                    CRawBlock rawblock;
+                    if (inv.type == MSG_BLOCK && ReadRawBlockFromDisk(pindex->GetBlockPos(), rawblock))
+                        pfrom->PushMappedMessage("block", rawblock.pfile, rawblock.pch, rawblock.nSize, rawblock.nChecksum);
+                    else if (inv.type == MSG_BLOCK)
+                        pfrom->PushPayload("block", GetBlockPayload(pindex));
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        block.ReadFromDisk(pindex);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3309,7 +4425,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3321,9 +4437,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CNetPayloadRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushPayload(inv.GetCommand(), (*mi).second);
                         pushed = true;
                     }
                 }
@@ -3685,7 +4801,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3700,7 +4816,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3712,6 +4828,33 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        // CBlocks with no transactions, see getheaders
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %" PRIszu "", vHeaders.size());
+        }
+        pfrom->nHeadersRequestTime = 0;
+
+        CValidationState state;
+        if (!ProcessBlockHeaders(state, vHeaders)) {
+            // sync headers from somebody else
+            pfrom->fSyncHeaders = false;
+            ReleaseSyncNode(pfrom);
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+        }
+        // a short batch means the peer has no more
+        else if (vHeaders.size() < MAX_HEADERS_RESULTS)
+            pfrom->fSyncHeaders = false;
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3803,14 +4946,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
+        MarkBlockAsReceived(inv.hash, pfrom);
 
         CValidationState state;
         if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
             mapAlreadyAskedFor.erase(inv);
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
+            if (nDoS > 0) {
                 pfrom->Misbehaving(nDoS);
+                // only if the transactions are the ones the header commits to
+                if (!state.CorruptionPossible() && block.hashMerkleRoot == block.BuildMerkleTree())
+                    InvalidBlockHeaderFound(inv.hash);
+            }
     }
 
 
@@ -3968,6 +5116,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that only touch the peer itself and data behind its own locks (relay memory,
+// mempool, the peer's filter) are handled by the message handler threads without cs_main
+bool static IsChainIndependentMessage(const string& strCommand)
+{
+    return strCommand == "verack" || strCommand == "ping" || strCommand == "getdata" ||
+           strCommand == "mempool" || strCommand == "filterload" || strCommand == "filteradd" ||
+           strCommand == "filterclear";
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4046,6 +5203,9 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (IsChainIndependentMessage(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -4085,8 +5245,11 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; itDone++)
+            netBufferPool.Put(itDone->vRecv);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -4094,27 +5257,106 @@ bool ProcessMessages(CNode* pfrom)
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (lockMain) {
-        // Don't send anything until we get their version message
-        if (pto->nVersion == 0)
-            return true;
+    // Don't send anything until we get their version message
+    if (pto->nVersion == 0)
+        return true;
 
-        // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
-        // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
-            uint64 nonce = 0;
-            if (pto->nVersion > BIP0031_VERSION)
-                pto->PushMessage("ping", nonce);
-            else
-                pto->PushMessage("ping");
+    // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
+    // right now.
+    if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
+        uint64 nonce = 0;
+        if (pto->nVersion > BIP0031_VERSION)
+            pto->PushMessage("ping", nonce);
+        else
+            pto->PushMessage("ping");
+    }
+
+    //
+    // Message: inventory
+    //
+    // Done without cs_main, so relaying does not wait for block processing. The wallet
+    // is asked before taking cs_inventory, relaying wallet transactions nests them the
+    // other way round.
+    vector<CInv> vInvToSend;
+    {
+        LOCK(pto->cs_inventory);
+        vInvToSend.swap(pto->vInventoryToSend);
+    }
+    vector<bool> vfTrickleWait(vInvToSend.size(), false);
+    for (unsigned int i = 0; i < vInvToSend.size(); i++)
+    {
+        const CInv& inv = vInvToSend[i];
+
+        // trickle out tx inv to protect privacy
+        if (inv.type == MSG_TX && !fSendTrickle)
+        {
+            // 1/4 of tx invs blast to all immediately
+            static const uint256 hashSalt = GetRandHash();
+            uint256 hashRand = inv.hash ^ hashSalt;
+            hashRand = Hash(BEGIN(hashRand), END(hashRand));
+            bool fTrickleWait = ((hashRand & 3) != 0);
+
+            // always trickle our own transactions
+            if (!fTrickleWait)
+            {
+                CWalletTx wtx;
+                if (GetTransaction(inv.hash, wtx))
+                    if (wtx.fFromMe)
+                        fTrickleWait = true;
+            }
+
+            vfTrickleWait[i] = fTrickleWait;
         }
+    }
+    vector<CInv> vInv;
+    vector<CInv> vInvWait;
+    {
+        LOCK(pto->cs_inventory);
+        vInv.reserve(vInvToSend.size());
+        vInvWait.reserve(vInvToSend.size());
+        for (unsigned int i = 0; i < vInvToSend.size(); i++)
+        {
+            const CInv& inv = vInvToSend[i];
+            if (pto->setInventoryKnown.count(inv))
+                continue;
+
+            if (vfTrickleWait[i])
+            {
+                vInvWait.push_back(inv);
+                continue;
+            }
+
+            // returns true if wasn't already contained in the set
+            if (pto->setInventoryKnown.insert(inv).second)
+            {
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
+                {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
+                }
+            }
+        }
+        // what was queued in the meantime goes behind what is held back
+        vInvWait.insert(vInvWait.end(), pto->vInventoryToSend.begin(), pto->vInventoryToSend.end());
+        pto->vInventoryToSend.swap(vInvWait);
+    }
+    if (!vInv.empty())
+        pto->PushMessage("inv", vInv);
 
+
+    TRY_LOCK(cs_main, lockMain);
+    if (lockMain) {
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            pto->PushGetBlocks(pindexBest, uint256(0));
+            if (fHeadersFirst && IsInitialBlockDownload())
+                pto->fSyncHeaders = true;
+            else
+                pto->PushGetBlocks(pindexBest, uint256(0));
         }
+        if (pto->fSyncHeaders && !fImporting && !fReindex)
+            RequestHeaders(pto);
 
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
@@ -4175,68 +5417,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         }
 
 
-        //
-        // Message: inventory
-        //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
-        {
-            LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
-            {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
-            }
-            pto->vInventoryToSend = vInvWait;
-        }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
-
-
         //
         // Message: getdata
         //
         vector<CInv> vGetData;
+        if (!vHeaderChain.empty() && !fImporting && !fReindex)
+            RequestBlocks(pto, vGetData);
         int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
@@ -4436,7 +5622,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
                     continue;
                 }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
+                const CCoins &coins = view.AccessCoins(txin.prevout.hash);
 
                 int64 nValueIn = coins.vout[txin.prevout.n].nValue;
                 nTotalIn += nValueIn;
@@ -4595,6 +5781,15 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
     return CreateNewBlock(scriptPubKey);
 }
 
+void SetExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int nExtraNonce)
+{
+    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -4605,11 +5800,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         hashPrevBlock = pblock->hashPrevBlock;
     }
     ++nExtraNonce;
-    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
-
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
 }
 
 
@@ -4694,113 +5885,224 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static GostcoinMiner(CWallet *pwallet)
+// Scan up to nCount nonces from pblock->nNonce for a hash at or below hashTarget.
+// Returns true with pblock->nNonce set to the solution; pblock->nNonce is advanced past the scanned range otherwise.
+static bool ScanHash(i2p::crypto::GOSTR3411_2012_HEADER_CTX* ctx, CBlockHeader* pblock, const uint256& hashTarget,
+                     unsigned int nCount, unsigned int& nHashesDone)
 {
-    printf("GostcoinMiner started\n");
+    // Everything but the nonce is hashed once for the whole range
+    i2p::crypto::GOSTR3411_2012_HEADER_CTX_Init(ctx, (const uint8_t*)BEGIN(pblock->nVersion));
+    for (nHashesDone = 0; nHashesDone < nCount; nHashesDone += 4)
+    {
+        uint256 hashes[4];
+        uint8_t* digest[4] = { hashes[0].begin(), hashes[1].begin(), hashes[2].begin(), hashes[3].begin() };
+        i2p::crypto::GOSTR3411_2012_HEADER_CTX_Hash_x4(ctx, pblock->nNonce + nHashesDone, digest);
+        for (int i = 0; i < 4; i++)
+        {
+            // CBlockHeader::GetHash returns the digest byte reversed
+            std::reverse(hashes[i].begin(), hashes[i].end());
+            if (hashes[i] <= hashTarget)
+            {
+                pblock->nNonce += nHashesDone + i;
+                nHashesDone += i + 1;
+                return true;
+            }
+        }
+    }
+    pblock->nNonce += nHashesDone;
+    return false;
+}
+
+//
+// Mining threads: one coordinator builds the block template and meters the
+// hash rate, the workers only hash. Worker i covers extranonces i+1, i+1+n, ...
+// with the full nonce range each, so no two workers ever hash the same header.
+//
+
+// Hashes done by one worker, on its own cache line and read by the coordinator without locking
+struct CMinerCounter
+{
+    std::atomic<uint64_t> nHashes;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+};
+
+static CCriticalSection cs_minerTemplate;
+static std::shared_ptr<CBlockTemplate> pminerTemplate;   // guarded by cs_minerTemplate
+static CBlockIndex* pminerTemplatePrev = NULL;           // guarded by cs_minerTemplate
+static std::atomic<unsigned int> nMinerTemplateId(0);
+static std::atomic<unsigned int> nMinerSolvedId(0); // template a worker has found a block on
+static CCriticalSection cs_minerKey; // CreateNewBlockWithKey and CheckWork share the reserve key
+
+static void SetMinerTemplate(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev)
+{
+    LOCK(cs_minerTemplate);
+    pminerTemplate.reset(pblocktemplate);
+    pminerTemplatePrev = pindexPrev;
+    nMinerTemplateId++;
+}
+
+void static GostcoinMinerCoordinator(CWallet *pwallet, CReserveKey* preservekey, CMinerCounter* pcounters, int nThreads)
+{
+    printf("GostcoinMinerCoordinator started\n");
+    RenameThread("gostcoin-minerctl");
+
+    try
+    {
+        loop
+        {
+            while (vNodes.empty())
+            {
+                SetMinerTemplate(NULL, NULL);
+                MilliSleep(1000);
+            }
+
+            //
+            // Create new block, once for all workers
+            //
+            unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
+            CBlockIndex* pindexPrev = pindexBest;
+
+            CBlockTemplate* pblocktemplate;
+            {
+                LOCK(cs_minerKey);
+                pblocktemplate = CreateNewBlockWithKey(*preservekey);
+            }
+            if (!pblocktemplate)
+                return;
+            printf("Running GostcoinMiner with %" PRIszu " transactions in block (%u bytes)\n", pblocktemplate->block.vtx.size(),
+                   ::GetSerializeSize(pblocktemplate->block, SER_NETWORK, PROTOCOL_VERSION));
+            SetMinerTemplate(pblocktemplate, pindexPrev);
+
+            int64 nStart = GetTime();
+            loop
+            {
+                MilliSleep(100);
+
+                // Meter hashes/sec
+                static uint64 nHashCounterLast;
+                if (nHPSTimerStart == 0)
+                {
+                    nHPSTimerStart = GetTimeMillis();
+                    nHashCounterLast = 0;
+                    for (int i = 0; i < nThreads; i++)
+                        nHashCounterLast += pcounters[i].nHashes.load(std::memory_order_relaxed);
+                }
+                else if (GetTimeMillis() - nHPSTimerStart > 4000)
+                {
+                    uint64 nHashCounter = 0;
+                    for (int i = 0; i < nThreads; i++)
+                        nHashCounter += pcounters[i].nHashes.load(std::memory_order_relaxed);
+                    dHashesPerSec = 1000.0 * (nHashCounter - nHashCounterLast) / (GetTimeMillis() - nHPSTimerStart);
+                    nHPSTimerStart = GetTimeMillis();
+                    nHashCounterLast = nHashCounter;
+                    static int64 nLogTime;
+                    if (GetTime() - nLogTime > 30 * 60)
+                    {
+                        nLogTime = GetTime();
+                        printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+                    }
+                }
+
+                // Check if block needs to be rebuilt
+                if (vNodes.empty())
+                    break;
+                if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+                    break;
+                if (pindexPrev != pindexBest)
+                    break;
+                if (nMinerSolvedId == nMinerTemplateId)
+                    break;
+            }
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        printf("GostcoinMinerCoordinator terminated\n");
+        throw;
+    }
+}
+
+void static GostcoinMiner(CWallet *pwallet, CReserveKey* preservekey, CMinerCounter* pcounter, int nWorker, int nThreads)
+{
+    printf("GostcoinMiner %d started\n", nWorker);
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("gostcoin-miner");
+    SetThreadAffinity(nWorker);
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
-
-    try 
-	{ 
-		loop 
-		{
-		
-		   while (vNodes.empty())
-		        MilliSleep(1000);
-
-		    //
-		    // Create new block
-		    //
-		    unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-		    CBlockIndex* pindexPrev = pindexBest;
-
-		    unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-		    if (!pblocktemplate.get())
-		        return;
-		    CBlock *pblock = &pblocktemplate->block;
-			RAND_bytes ((uint8_t *)&pblock->nNonce, 4);
-		    IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-		    printf("Running GostcoinMiner with %" PRIszu " transactions in block (%u bytes)\n", pblock->vtx.size(),
-		           ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
-
-		    //
-		    // Solve
-		    //
-		    int64 nStart = GetTime();
-		    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-		    loop
-		    {
-		        unsigned int nHashesDone = 0;
-
-		        loop
-		        {
-		            if (pblock->GetHash() <= hashTarget)
-		            {
-		                // Found a solution
-		                SetThreadPriority(THREAD_PRIORITY_NORMAL);
-		                CheckWork(pblock, *pwallet, reservekey);
-		                SetThreadPriority(THREAD_PRIORITY_LOWEST);
-		                break;
-		            }
-		            pblock->nNonce += 1;
-		            nHashesDone += 1;
-		            if ((pblock->nNonce & 0xFF) == 0)
-		                break;
-		        }
-
-		        // Meter hashes/sec
-		        static int64 nHashCounter;
-		        if (nHPSTimerStart == 0)
-		        {
-		            nHPSTimerStart = GetTimeMillis();
-		            nHashCounter = 0;
-		        }
-		        else
-		            nHashCounter += nHashesDone;
-		        if (GetTimeMillis() - nHPSTimerStart > 4000)
-		        {
-		            static CCriticalSection cs;
-		            {
-		                LOCK(cs);
-		                if (GetTimeMillis() - nHPSTimerStart > 4000)
-		                {
-		                    dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-		                    nHPSTimerStart = GetTimeMillis();
-		                    nHashCounter = 0;
-		                    static int64 nLogTime;
-		                    if (GetTime() - nLogTime > 30 * 60)
-		                    {
-		                        nLogTime = GetTime();
-		                        printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-		                    }
-		                }
-		            }
-		        }
-
-		        // Check for stop or if block needs to be rebuilt
-		        boost::this_thread::interruption_point();
-		        if (vNodes.empty())
-		            break;
-		        if (pblock->nNonce >= 0xffff0000)
-		            break;
-		        if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-		            break;
-		        if (pindexPrev != pindexBest)
-		            break;
-
-		        // Update nTime every few seconds
-		        pblock->UpdateTime(pindexPrev);
-		    }
-	    } 
-	}
+    std::unique_ptr<i2p::crypto::GOSTR3411_2012_HEADER_CTX, void (*)(i2p::crypto::GOSTR3411_2012_HEADER_CTX*)>
+        ctx(i2p::crypto::GOSTR3411_2012_HEADER_CTX_new(), i2p::crypto::GOSTR3411_2012_HEADER_CTX_free);
+
+    try
+    {
+        loop
+        {
+            // Take a private copy of the current template
+            CBlock block;
+            CBlockIndex* pindexPrev;
+            unsigned int nTemplateId;
+            {
+                LOCK(cs_minerTemplate);
+                nTemplateId = nMinerTemplateId;
+                pindexPrev = pminerTemplatePrev;
+                if (pminerTemplate)
+                    block = pminerTemplate->block;
+            }
+            if (!pindexPrev)
+            {
+                MilliSleep(100);
+                continue;
+            }
+
+            //
+            // Solve
+            //
+            uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+            bool fStale = false;
+            for (unsigned int nExtraNonce = nWorker + 1; !fStale; nExtraNonce += nThreads)
+            {
+                SetExtraNonce(&block, pindexPrev, nExtraNonce);
+                block.nNonce = 0;
+                do
+                {
+                    unsigned int nHashesDone = 0;
+                    bool fFound = ScanHash(ctx.get(), &block, hashTarget, 0x10000, nHashesDone);
+                    pcounter->nHashes.fetch_add(nHashesDone, std::memory_order_relaxed);
+                    if (fFound)
+                    {
+                        // Found a solution
+                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                        {
+                            LOCK(cs_minerKey);
+                            CheckWork(&block, *pwallet, *preservekey);
+                        }
+                        nMinerSolvedId = nTemplateId;
+                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                        fStale = true;
+                        break;
+                    }
+
+                    // Check for stop or if the coordinator has a new template
+                    boost::this_thread::interruption_point();
+                    if (nMinerTemplateId != nTemplateId || pindexPrev != pindexBest)
+                    {
+                        fStale = true;
+                        break;
+                    }
+
+                    // Update nTime every few seconds
+                    block.UpdateTime(pindexPrev);
+                }
+                while (block.nNonce != 0);
+            }
+
+            // Wait for the coordinator to replace a template we found a block on
+            while (nMinerTemplateId == nTemplateId)
+                MilliSleep(100);
+        }
+    }
     catch (boost::thread_interrupted)
     {
-        printf("GostcoinMiner terminated\n");
+        printf("GostcoinMiner %d terminated\n", nWorker);
         throw;
     }
 }
@@ -4808,24 +6110,40 @@ void static GostcoinMiner(CWallet *pwallet)
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
 {
     static boost::thread_group* minerThreads = NULL;
+    static CReserveKey* pminerReserveKey = NULL;
+    static CMinerCounter* pminerCounters = NULL;
 
     int nThreads = GetArg("-genproclimit", 1);
-   /* if (nThreads < 0)
-        nThreads = boost::thread::hardware_concurrency();*/
+    if (nThreads < 0)
+        nThreads = boost::thread::hardware_concurrency();
 
     if (minerThreads != NULL)
     {
+        // Workers share the key and counters, so wait for all of them before freeing
         minerThreads->interrupt_all();
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = NULL;
+        delete pminerReserveKey;
+        pminerReserveKey = NULL;
+        delete[] pminerCounters;
+        pminerCounters = NULL;
+        SetMinerTemplate(NULL, NULL);
     }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
+    pminerReserveKey = new CReserveKey(pwallet);
+    pminerCounters = new CMinerCounter[nThreads];
+    for (int i = 0; i < nThreads; i++)
+        pminerCounters[i].nHashes = 0;
+    nHPSTimerStart = 0;
+
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(boost::bind(&GostcoinMinerCoordinator, pwallet, pminerReserveKey, pminerCounters, nThreads));
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&GostcoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&GostcoinMiner, pwallet, pminerReserveKey, &pminerCounters[i], i, nThreads));
 }
 
 // Amount compression:
@@ -4888,11 +6206,13 @@ class CMainCleanup
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
-        // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers, those of mapBlockIndex go with blockIndexArena
         mapBlockIndex.clear();
+        BlockMap::iterator it1;
+        for (it1 = mapHeaderIndex.begin(); it1 != mapHeaderIndex.end(); it1++)
+            delete (*it1).second;
+        mapHeaderIndex.clear();
+        vHeaderChain.clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
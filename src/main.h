@@ -9,10 +9,14 @@
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "pooledmap.h"
 
 #include "Gost.h" // i2pd
 
+#include <deque>
 #include <list>
+#include <memory>
+#include <boost/unordered_map.hpp>
 
 class CWallet;
 class CBlock;
@@ -26,6 +30,13 @@ class CNode;
 
 struct CBlockIndexWorkComparator;
 
+/** Block hashes are already random, their low bits are good enough as hash */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 1000000;                      // 1000KB block hard limit
 /** The maximum size for mined blocks */
@@ -59,6 +70,18 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** The maximum number of headers in a 'headers' protocol message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers-first: the blocks of this many headers past the block chain are downloaded at once */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Headers-first: the maximum number of blocks requested from one peer at a time */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Headers-first: no more headers are requested while this many are waiting for their blocks */
+static const unsigned int MAX_HEADERS_AHEAD = 50000;
+/** Headers-first: seconds after which a requested block is asked from another peer; I2P is slow */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 5 * 60;
+/** Headers-first: seconds after which a headers request is given up */
+static const int64 HEADERS_DOWNLOAD_TIMEOUT = 10 * 60;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -74,7 +97,7 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -98,7 +121,10 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+extern bool fHeadersFirst;
+extern BlockMap mapHeaderIndex;
+extern std::deque<CBlockIndex*> vHeaderChain;
 
 // Settings
 extern int64 nTransactionFee;
@@ -135,6 +161,16 @@ bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** A block as it lies in a memory-mapped block file, ready to be sent as it is */
+struct CRawBlock
+{
+    std::shared_ptr<const CMappedFile> pfile; // keeps pch valid
+    const char* pch;
+    unsigned int nSize;
+    unsigned int nChecksum; // of a "block" message with this payload
+};
+/** Get the block at pos from its mapped block file, without deserializing it */
+bool ReadRawBlockFromDisk(const CDiskBlockPos &pos, CRawBlock &block);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -143,12 +179,18 @@ bool InitBlockIndex();
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Save the block index for a fast start, unless the last snapshot is still current */
+bool WriteBlockIndexSnapshot();
 /** Verify consistency of the block and coin databases */
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
 /** Print the loaded block tree */
 void PrintBlockTree();
+/** Drop the headers whose blocks got into the block index from the front of vHeaderChain */
+void PruneHeaderChain();
 /** Find a block by height in the currently-connected chain */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Find the first block in the currently-connected chain that may hold transactions from nTime on */
+CBlockIndex* FindBlockByTime(int64 nTime);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
@@ -160,6 +202,8 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
+/** Set the extranonce in a block's coinbase and rebuild its merkle root */
+void SetExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int nExtraNonce);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Do mining precalculation */
@@ -178,10 +222,12 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
-/** Connect/disconnect blocks until pindexNew is the new tip of the active block chain */
-bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew);
-/** Find the best known block, and make it the tip of the block chain */
-bool ConnectBestBlock(CValidationState &state);
+/** Connect/disconnect blocks until pindexNew is the new tip of the active block chain.
+ *  pblockNew is the block of pindexNew, if the caller has it in memory already. */
+bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew, CBlock *pblockNew = NULL);
+/** Find the best known block, and make it the tip of the block chain.
+ *  pblock is the block of pindexBlock if that is still in memory. */
+bool ConnectBestBlock(CValidationState &state, CBlock *pblock = NULL, CBlockIndex *pindexBlock = NULL);
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Verify a signature */
@@ -1085,6 +1131,18 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory held by the outputs, with allocations rounded up the way malloc does
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = MallocUsage(vout.capacity() * sizeof(CTxOut));
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += MallocUsage(out.scriptPubKey.capacity());
+        return nUsage;
+    }
+
+    static size_t MallocUsage(size_t nAlloc) {
+        return nAlloc == 0 ? 0 : ((nAlloc + 31) >> 4) << 4;
+    }
 };
 
 /** Closure representing one script verification
@@ -1097,12 +1155,14 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    std::shared_ptr<const CSignatureHashCache> psighashcache; // shared by the checks of one transaction
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const std::shared_ptr<const CSignatureHashCache> &psighashcacheIn = std::shared_ptr<const CSignatureHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighashcache(psighashcacheIn) { }
 
     bool operator()() const;
 
@@ -1112,9 +1172,13 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        psighashcache.swap(check.psighashcache);
     }
 };
 
+/** Run script checks with their OP_CHECKSIG signatures verified as one batch */
+bool CheckBatch(std::vector<CScriptCheck> &vChecks);
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -1335,6 +1399,7 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable uint256 hashChecked; // header hash when CheckBlock last passed with all checks
 
     CBlock()
     {
@@ -1358,6 +1423,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        hashChecked = 0;
     }
 
     CBlockHeader GetBlockHeader() const
@@ -1375,20 +1441,51 @@ public:
     uint256 BuildMerkleTree() const
     {
         vMerkleTree.clear();
+        if (vtx.empty())
+            return 0;
+
+        // Transaction hashes, same as tx.GetHash() but the whole block in lockstep
+        CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+        std::vector<unsigned int> vOffset;
+        vOffset.reserve(vtx.size() + 1);
         BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
+        {
+            vOffset.push_back(ss.size());
+            ss << tx;
+        }
+        vOffset.push_back(ss.size());
+        std::vector<const unsigned char*> vpch(vtx.size());
+        std::vector<size_t> vLen(vtx.size());
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            vpch[i] = (const unsigned char*)&ss[0] + vOffset[i];
+            vLen[i] = vOffset[i+1] - vOffset[i];
+        }
+        vMerkleTree.resize(vtx.size());
+        HashBatch(vtx.size(), &vpch[0], &vLen[0], &vMerkleTree[0]);
+
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
+            // Build the same input Hash(BEGIN(a), END(a), BEGIN(b), END(b)) would,
+            // it repeats its first range, and hash the whole level in lockstep
+            int nPairs = (nSize + 1) / 2;
+            std::vector<unsigned char> vch(nPairs * 64);
             for (int i = 0; i < nSize; i += 2)
             {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+                memcpy(&vch[i * 32], BEGIN(vMerkleTree[j+i]), 32);
+                memcpy(&vch[i * 32 + 32], BEGIN(vMerkleTree[j+i]), 32);
+            }
+            for (int i = 0; i < nPairs; i++)
+            {
+                vpch[i] = &vch[i * 64];
+                vLen[i] = 64;
             }
+            vMerkleTree.resize(j + nSize + nPairs);
+            HashBatch(nPairs, &vpch[0], &vLen[0], &vMerkleTree[j + nSize]);
             j += nSize;
         }
-        return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+        return vMerkleTree.back();
     }
 
     const uint256 &GetTxHash(unsigned int nIndex) const {
@@ -1621,6 +1718,9 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
+    // (memory only) pointer to an ancestor further back, so any ancestor is reached in O(log n) steps
+    CBlockIndex* pskip;
+
     // (memory only) pointer to the index of the *active* successor of this block
     CBlockIndex* pnext;
 
@@ -1664,6 +1764,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         pnext = NULL;
         nHeight = 0;
         nFile = 0;
@@ -1686,6 +1787,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         pnext = NULL;
         nHeight = 0;
         nFile = 0;
@@ -1759,6 +1861,13 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    // Set pskip from pprev, which must already have its own
+    void BuildSkip();
+
+    // The ancestor at the given height, or NULL if it is above this one
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     bool CheckIndex() const
     {
         /** Scrypt is used for block proof-of-work, but for purposes of performance the index internally uses sha256.
@@ -1977,7 +2086,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -2013,8 +2122,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->nHeight >= nStep ? pindex->GetAncestor(pindex->nHeight - nStep) : NULL;
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -2028,7 +2136,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2047,7 +2155,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2063,7 +2171,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2124,19 +2232,83 @@ public:
 
 extern CTxMemPool mempool;
 
+/** Statistics about the unspent transaction output set, or about a change to it.
+ *  They are maintained as blocks are connected and disconnected. hashSet is the sum
+ *  (modulo 2^256) of GetOutputHash() over all unspent outputs, so it does not depend
+ *  on the order in which the set was built and can be updated one output at a time. */
 struct CCoinsStats
 {
     int nHeight;
     uint256 hashBlock;
-    uint64 nTransactions;
-    uint64 nTransactionOutputs;
-    uint64 nSerializedSize;
-    uint256 hashSerialized;
+    int64 nTransactions;
+    int64 nTransactionOutputs;
+    int64 nSerializedSize;
+    uint256 hashSet;
     int64 nTotalAmount;
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSet(0), nTotalAmount(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(hashSet);
+        READWRITE(nTotalAmount);
+    )
+
+    static uint256 GetOutputHash(const uint256 &txid, unsigned int n, const CCoins &coins, const CTxOut &out);
+
+    // account for output n of txid, with the height and coinbase flag of coins
+    void AddOutput(const uint256 &txid, unsigned int n, const CCoins &coins, const CTxOut &out);
+    void RemoveOutput(const uint256 &txid, unsigned int n, const CCoins &coins, const CTxOut &out);
+
+    // account for the database record of a transaction (not its outputs)
+    void AddCoins(const CCoins &coins);
+    void RemoveCoins(const CCoins &coins);
+
+    // add the totals of another change; nHeight and hashBlock are left alone
+    CCoinsStats &operator+=(const CCoinsStats &delta);
+
+    bool operator==(const CCoinsStats &b) const {
+        return nTransactions == b.nTransactions && nTransactionOutputs == b.nTransactionOutputs &&
+               nSerializedSize == b.nSerializedSize && hashSet == b.hashSet && nTotalAmount == b.nTotalAmount;
+    }
 };
 
+/** A CCoins in a CCoinsViewCache, with its state relative to the parent view */
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char flags;
+
+    enum Flags {
+        DIRTY = (1 << 0),   // differs from the parent view
+        FRESH = (1 << 1),   // the parent view has no unspent outputs for it, so it can be dropped once pruned
+        PENDING = (1 << 2), // handed out for modification, its memory usage is not accounted yet
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0) {}
+};
+
+/** Salted hash of a txid for CCoinsMap; txids are chosen by others, so buckets must not be predictable */
+class CCoinsKeyHasher
+{
+private:
+    uint64 k0, k1, k2, k3;
+
+public:
+    CCoinsKeyHasher();
+
+    uint64 operator()(const uint256 &txid) const {
+        uint64 h = ((txid.Get64(0) + k0) * (txid.Get64(1) + k1)) ^ ((txid.Get64(2) + k2) * (txid.Get64(3) + k3));
+        return h ^ (h >> 32);
+    }
+};
+
+typedef pooledmap<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2157,12 +2329,19 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock).
+    // Only DIRTY entries of mapCoins are applied; their coins may be moved out,
+    // so the caller has to discard mapCoins afterwards.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
-    // Calculate statistics about the unspent transaction output set
+    // Retrieve the maintained statistics about the unspent transaction output set.
+    // Returns false if they are not known (a chainstate from an older version).
     virtual bool GetStats(CCoinsStats &stats);
 
+    // Add a change to the statistics, made by the modifications that the next
+    // BatchWrite will carry
+    virtual bool UpdateStats(const CCoinsStats &delta);
+
     // As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -2181,8 +2360,9 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    bool UpdateStats(const CCoinsStats &delta);
 };
 
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
@@ -2190,7 +2370,10 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+    size_t cachedCoinsUsage; // heap memory of the cached coins, without the PENDING ones
+    std::vector<CCoinsCacheEntry*> vPending;
+    CCoinsStats statsDelta; // change to the statistics of the base, pushed on Flush
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2201,13 +2384,22 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+    bool UpdateStats(const CCoinsStats &delta);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is marked as modified, use AccessCoins to only read it.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a read-only reference to a CCoins. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
+    // Like SetCoins, for the outputs of a transaction whose txid has no unspent outputs
+    // in this view (see BIP30), so they need never reach the parent if spent before a flush.
+    bool SetNewCoins(const uint256 &txid, const CCoins &coins);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -2215,8 +2407,13 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache, in bytes
+    size_t DynamicMemoryUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::value_type *FetchCoins(const uint256 &txid);
+    void SetEntry(CCoinsCacheEntry &entry, const CCoins &coins);
+    void AccountPending();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -15,6 +15,11 @@
 #include <string.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -30,6 +35,8 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 27;
+// Most connections taken off a listening socket in one round of the socket handler
+static const int MAX_ACCEPT_BATCH = 64;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
@@ -58,11 +65,20 @@ int nMaxConnections = 200;
 static std::vector<SOCKET> vhI2PListenSocket;
 int nI2PNodeCount = 0;
 
+#ifdef USE_EPOLL
+// Sockets of nodes stay in the epoll set from connect until they are closed (which drops
+// them from the set), edge-triggered with their CNode* as data. EPOLLOUT is only asked for
+// while vSendMsg is not empty. Listening sockets are level-triggered and share one marker.
+static int hEpoll = -1;
+static char chEpollListen;
+#endif
+
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetPayloadRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
+CNetBufferPool netBufferPool;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -488,6 +504,55 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+// Add the socket of a node to the epoll set, or update its write interest once it is there.
+// requires LOCK(cs_vSend)
+static void PollNodeSocket(CNode *pnode, bool fAdd)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET || (!fAdd && !pnode->fPollRegistered))
+        return;
+    bool fSend = !pnode->vSendMsg.empty();
+    if (pnode->fPollRegistered && pnode->fPollSend == fSend)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (fSend)
+        event.events |= EPOLLOUT;
+    event.data.ptr = pnode;
+    int nRet = epoll_ctl(hEpoll, pnode->fPollRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pnode->hSocket, &event);
+    // an incoming I2P connection arrives on a socket that was registered as listening
+    if (nRet == SOCKET_ERROR && errno == EEXIST)
+        nRet = epoll_ctl(hEpoll, EPOLL_CTL_MOD, pnode->hSocket, &event);
+    if (nRet == SOCKET_ERROR)
+    {
+        printf("epoll_ctl failed for %s: %d\n", pnode->addrName.c_str(), errno);
+        return;
+    }
+    pnode->fPollRegistered = true;
+    pnode->fPollSend = fSend;
+#endif
+}
+
+// Called once a new node is in vNodes
+static void RegisterNodeSocket(CNode *pnode)
+{
+    LOCK(pnode->cs_vSend);
+    PollNodeSocket(pnode, true);
+}
+
+static void RegisterListenSocket(SOCKET hListenSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || hListenSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &chEpollListen;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == SOCKET_ERROR && errno != EEXIST)
+        printf("epoll_ctl failed for listening socket: %d\n", errno);
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -538,6 +603,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             if (addrConnect.IsNativeI2P())
                 ++nI2PNodeCount;
         }
+        RegisterNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -591,6 +657,8 @@ void CNode::PushVersion()
 
 std::map<CNetAddr, int64> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+int64 CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 void CNode::ClearBanned()
 {
@@ -666,8 +734,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
-            vRecvMsg.back().complete())
+            vRecvMsg.back().complete()) {
             vRecvMsg.push_back(CNetMessage(nRecvStreamType, nRecvVersion));
+            netBufferPool.Get(vRecvMsg.back().vRecv);
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -729,6 +799,7 @@ void AddIncomingConnection(SOCKET hSocket, const CAddress& addr)
             vNodes.push_back(pnode);
             ++nI2PNodeCount;
         }
+        RegisterNodeSocket(pnode);
     }
 }
 
@@ -784,25 +855,74 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+// Most pieces of queued messages handed to the kernel in one send
+static const int MAX_SEND_PIECES = 16;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        // Gather the rest of the first message and the ones after it, mapped tails
+        // are sent from where they lie
+        assert(it->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSendMessage &msg = *it;
+        size_t nWant;
+        int nBytes;
+        if (pnode->nSendOffset < msg.vch.size()) {
+            nWant = msg.vch.size() - pnode->nSendOffset;
+            nBytes = send(pnode->hSocket, &msg.vch[pnode->nSendOffset], nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } else {
+            nWant = msg.size() - pnode->nSendOffset;
+            nBytes = send(pnode->hSocket, msg.pchTail + (pnode->nSendOffset - msg.vch.size()), nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+#else
+        struct iovec vPieces[MAX_SEND_PIECES];
+        int nPieces = 0;
+        size_t nWant = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSendMessage>::iterator itMsg = it; itMsg != pnode->vSendMsg.end() && nPieces + 2 <= MAX_SEND_PIECES; itMsg++) {
+            const CSendMessage &msg = *itMsg;
+            if (nOffset < msg.vch.size()) {
+                vPieces[nPieces].iov_base = (void*)&msg.vch[nOffset];
+                vPieces[nPieces].iov_len = msg.vch.size() - nOffset;
+                nWant += vPieces[nPieces++].iov_len;
+                nOffset = 0;
+            } else
+                nOffset -= msg.vch.size();
+            if (nOffset < msg.nTail) {
+                vPieces[nPieces].iov_base = (void*)(msg.pchTail + nOffset);
+                vPieces[nPieces].iov_len = msg.nTail - nOffset;
+                nWant += vPieces[nPieces++].iov_len;
+            }
+            nOffset = 0;
+        }
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = vPieces;
+        hdr.msg_iovlen = nPieces;
+        int nBytes = sendmsg(pnode->hSocket, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // step over what went out
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = it->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nWant) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -824,7 +944,10 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
+    for (std::deque<CSendMessage>::iterator itSent = pnode->vSendMsg.begin(); itSent != it; itSent++)
+        netBufferPool.Put(itSent->vch);
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    PollNodeSocket(pnode, false);
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -833,6 +956,12 @@ void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
     int nPrevI2PNodeCount = 0;
+#ifdef USE_EPOLL
+    if (!IsI2POnly())
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            RegisterListenSocket(hListenSocket);
+    int nPollTimeout = 0;
+#endif
     loop
     {
         //
@@ -920,83 +1049,134 @@ void ThreadSocketHandler()
         FD_ZERO(&fdsetRecv);
         FD_ZERO(&fdsetSend);
         FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        bool fListenEvent = false;
 
-        BOOST_FOREACH(SOCKET hI2PListenSocket, vhI2PListenSocket) {
-            if (hI2PListenSocket != INVALID_SOCKET)
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+        {
+            // Nothing is rebuilt here: node sockets report their own edges and the readiness
+            // latched in the node stays until a recv or send has used it up
+            struct epoll_event vEvents[256];
+            int nEvents = epoll_wait(hEpoll, vEvents, 256, nPollTimeout);
+            boost::this_thread::interruption_point();
+
+            if (nEvents == SOCKET_ERROR)
             {
-                FD_SET(hI2PListenSocket, &fdsetRecv);
-                hSocketMax = max(hSocketMax, hI2PListenSocket);
-                have_fds = true;
+                int nErr = errno;
+                if (nErr != EINTR)
+                {
+                    printf("socket epoll error %d\n", nErr);
+                    MilliSleep(timeout.tv_usec/1000);
+                }
+                nEvents = 0;
             }
-        }
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
+            for (int i = 0; i < nEvents; i++)
+            {
+                if (vEvents[i].data.ptr == &chEpollListen)
+                {
+                    fListenEvent = true;
+                    continue;
+                }
+                // nodes are only deleted by this thread, and only after their socket was closed
+                CNode* pnode = (CNode*)vEvents[i].data.ptr;
+                if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketReadable = true;
+                if (vEvents[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketWritable = true;
+            }
         }
+        else
+#endif
+        {
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
 
+            BOOST_FOREACH(SOCKET hI2PListenSocket, vhI2PListenSocket) {
+                if (hI2PListenSocket != INVALID_SOCKET)
+                {
+                    FD_SET(hI2PListenSocket, &fdsetRecv);
+                    hSocketMax = max(hSocketMax, hI2PListenSocket);
+                    have_fds = true;
+                }
+            }
 
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
                 have_fds = true;
+            }
+
 
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    if (pnode->hSocket == INVALID_SOCKET)
                         continue;
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+
+                    // Implement the following logic:
+                    // * If there is data to send, select() for sending data. As this only
+                    //   happens when optimistic write failed, we choose to first drain the
+                    //   write buffer in this case before receiving more. This avoids
+                    //   needlessly queueing received data, if the remote peer is not themselves
+                    //   receiving data. This means properly utilizing TCP flow control signalling.
+                    // * Otherwise, if there is no (complete) message in the receive buffer,
+                    //   or there is space left in the buffer, select() for receiving data.
+                    // * (if neither of the above applies, there is certainly one message
+                    //   in the receiver buffer ready to be processed).
+                    // Together, that means that at least one of the following is always possible,
+                    // so we don't deadlock:
+                    // * We send some data.
+                    // * We wait for data to be received (and disconnect after timeout).
+                    // * We process a message in the buffer (message handler thread).
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend && !pnode->vSendMsg.empty()) {
+                            FD_SET(pnode->hSocket, &fdsetSend);
+                            continue;
+                        }
+                    }
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv && (
+                            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                            FD_SET(pnode->hSocket, &fdsetRecv);
                     }
                 }
+            }
+
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
+
+            if (nSelect == SOCKET_ERROR)
+            {
+                if (have_fds)
                 {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                    int nErr = WSAGetLastError();
+                    printf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
                 }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    bool fValid = (pnode->hSocket != INVALID_SOCKET);
+                    pnode->fSocketReadable = fValid && (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError));
+                    pnode->fSocketWritable = fValid && FD_ISSET(pnode->hSocket, &fdsetSend);
+                }
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
 
@@ -1005,22 +1185,9 @@ void ThreadSocketHandler()
         //
         if (!IsI2POnly())
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && (fListenEvent || FD_ISSET(hListenSocket, &fdsetRecv)))
         {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
             int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
             {
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
@@ -1028,33 +1195,53 @@ void ThreadSocketHandler()
                         nInbound++;
             }
 
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+            // The listening socket is non-blocking, take what has queued up
+            for (int nAccept = 0; nAccept < MAX_ACCEPT_BATCH; nAccept++)
             {
+#ifdef USE_IPV6
+                struct sockaddr_storage sockaddr;
+#else
+                struct sockaddr sockaddr;
+#endif
+                socklen_t len = sizeof(sockaddr);
+                SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+                CAddress addr;
+
+                if (hSocket == INVALID_SOCKET)
                 {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
+                    int nErr = WSAGetLastError();
+                    if (nErr != WSAEWOULDBLOCK)
+                        printf("socket error accept failed: %d\n", nErr);
+                    break;
                 }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
+
+                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+                    printf("Warning: Unknown socket family\n");
+
+                if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+                {
+                    {
+                        LOCK(cs_setservAddNodeAddresses);
+                        if (!setservAddNodeAddresses.count(addr))
+                            closesocket(hSocket);
+                    }
+                }
+                else if (CNode::IsBanned(addr))
                 {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
+                    printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+                    closesocket(hSocket);
+                }
+                else
+                {
+                    printf("accepted connection %s\n", addr.ToString().c_str());
+                    CNode* pnode = new CNode(hSocket, addr, "", true);
+                    pnode->AddRef();
+                    {
+                        LOCK(cs_vNodes);
+                        vNodes.push_back(pnode);
+                    }
+                    RegisterNodeSocket(pnode);
+                    nInbound++;
                 }
             }
         }
@@ -1074,7 +1261,7 @@ void ThreadSocketHandler()
                         BindListenNativeI2P(hI2PListenSocket);
                     haveInvalids = true;
                 }
-                else if (FD_ISSET(hI2PListenSocket, &fdsetRecv))
+                else if (fListenEvent || FD_ISSET(hI2PListenSocket, &fdsetRecv))
                 {
                     const size_t bufSize = NATIVE_I2P_DESTINATION_SIZE + 1;
                     char pchBuf[bufSize];
@@ -1135,6 +1322,9 @@ void ThreadSocketHandler()
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        bool fMoreData = false; // a socket may have more to read right away
+        bool fDeferred = false; // a ready socket had to be left for the next round
+        vector<CNode*> vNodesReceived; // have a complete message for the message handler
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
@@ -1144,19 +1334,32 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fSocketReadable)
             {
+                // Drain the send queue before reading more, and leave a full receive buffer
+                // to the message handler, the same rule decides what select() waits for
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (!lockRecv || pnode->nSendSize > 0 ||
+                    (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                     pnode->GetTotalRecvSize() > ReceiveFloodSize()))
+                    fDeferred = true;
+                else
                 {
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // a short read used up the edge, the next data raises another one
+                        if (nBytes == (int)sizeof(pchBuf) || (nBytes < 0 && WSAGetLastError() == WSAEINTR))
+                            fMoreData = true;
+                        else
+                            pnode->fSocketReadable = false;
                         if (nBytes > 0)
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
+                            else if (pnode->vRecvMsg.front().complete())
+                                vNodesReceived.push_back(pnode);
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                         }
@@ -1187,11 +1390,17 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketWritable)
             {
+                // if this leaves something behind, the socket is full and EPOLLOUT is armed
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
                     SocketSendData(pnode);
+                    pnode->fSocketWritable = false;
+                }
+                else
+                    fDeferred = true;
             }
 
             //
@@ -1220,10 +1429,18 @@ void ThreadSocketHandler()
         }
         {
             LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesReceived)
+                ScheduleMessageHandler(pnode);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
 
+#ifdef USE_EPOLL
+        // An idle node only needs to come around for timeouts and disconnects
+        if (hEpoll != -1)
+            nPollTimeout = fMoreData ? 0 : (fDeferred ? 10 : 500);
+        else
+#endif
         MilliSleep(10);
     }
 }
@@ -1699,7 +1916,7 @@ void static StartSync(const vector<CNode*> &vNodes) {
     // Iterate over all nodes
     BOOST_FOREACH(CNode* pnode, vNodes) {
         // check preconditions for allowing a sync
-        if (!pnode->fClient && !pnode->fOneShot &&
+        if (!pnode->fClient && !pnode->fOneShot && !pnode->fSyncFailed &&
             !pnode->fDisconnect && pnode->fSuccessfullyConnected &&
             (pnode->nStartingHeight > (nBestHeight - 144)) &&
             (pnode->nVersion < NOBLKS_VERSION_START || pnode->nVersion >= NOBLKS_VERSION_END)) {
@@ -1718,40 +1935,109 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// Give up on syncing from pnode; the next sweep of the message handler picks another node
+void ReleaseSyncNode(CNode *pnode)
+{
+    LOCK(cs_vNodes);
+    pnode->fSyncFailed = true;
+    if (pnode == pnodeSync)
+        pnodeSync = NULL;
+}
+
+//
+// Message handler pool. A node with something to do is queued once and served by one
+// worker at a time. Workers wake up when the socket thread has received a message for
+// a node or something is relayed to it, and sweep all nodes every MSGHAND_SWEEP_INTERVAL
+// ms for the periodic work of SendMessages (trickle, keep-alive, block requests).
+//
+static const int64 MSGHAND_SWEEP_INTERVAL = 100;
+static boost::mutex mutexMsgHand;
+static boost::condition_variable condMsgHand;
+static deque<CNode*> vMsgHandQueue;
+static int64 nLastMsgHandSweep = 0;
+static CNode* pnodeTrickle = NULL; // only compared, may be stale
+int nMessageHandlerThreads = 1;
+
+// requires LOCK(cs_vNodes)
+void ScheduleMessageHandler(CNode* pnode)
+{
+    boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+    if (pnode->fMsgHandRunning)
+        pnode->fMsgHandAgain = true;
+    else if (!pnode->fMsgHandQueued)
+    {
+        pnode->fMsgHandQueued = true;
+        pnode->AddRef();
+        vMsgHandQueue.push_back(pnode);
+        condMsgHand.notify_one();
+    }
+}
+
+void static SweepMessageHandler()
+{
+    LOCK(cs_vNodes);
+
+    bool fHaveSyncNode = false;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        if (pnode == pnodeSync)
+            fHaveSyncNode = true;
+    if (!fHaveSyncNode)
+        StartSync(vNodes);
+
+    if (!vNodes.empty())
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+        pnodeTrickle = vNodes[GetRand(vNodes.size())];
+    }
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        if (!pnode->fDisconnect)
+            ScheduleMessageHandler(pnode);
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
-        bool fHaveSyncNode = false;
-
-        vector<CNode*> vNodesCopy;
+        CNode* pnode = NULL;
+        bool fSweep = false;
+        bool fTrickle = false;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
+            boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+            int64 nWait = nLastMsgHandSweep + MSGHAND_SWEEP_INTERVAL - GetTimeMillis();
+            if (vMsgHandQueue.empty() && nWait > 0)
+                condMsgHand.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            if (GetTimeMillis() >= nLastMsgHandSweep + MSGHAND_SWEEP_INTERVAL)
+            {
+                nLastMsgHandSweep = GetTimeMillis();
+                fSweep = true;
+            }
+            else if (!vMsgHandQueue.empty())
+            {
+                pnode = vMsgHandQueue.front();
+                vMsgHandQueue.pop_front();
+                pnode->fMsgHandQueued = false;
+                pnode->fMsgHandRunning = true;
+                pnode->fMsgHandAgain = false;
+                fTrickle = (pnode == pnodeTrickle);
+                if (fTrickle)
+                    pnodeTrickle = NULL;
             }
         }
+        boost::this_thread::interruption_point();
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
-
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
-        bool fSleep = true;
-
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        if (fSweep)
         {
-            if (pnode->fDisconnect)
-                continue;
+            SweepMessageHandler();
+            continue;
+        }
+        if (pnode == NULL)
+            continue;
 
-            // Receive messages
+        bool fMore = false;
+        if (!pnode->fDisconnect)
+        {
+            // Receive messages, one per turn so that busy peers take turns
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1763,10 +2049,12 @@ void ThreadMessageHandler()
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
-                            fSleep = false;
+                            fMore = true;
                         }
                     }
                 }
+                else
+                    fMore = true;
             }
             boost::this_thread::interruption_point();
 
@@ -1774,19 +2062,25 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                    SendMessages(pnode, fTrickle);
             }
             boost::this_thread::interruption_point();
         }
 
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+            pnode->fMsgHandRunning = false;
+            if ((fMore || pnode->fMsgHandAgain) && !pnode->fDisconnect)
+            {
+                // back of the queue, keeping the reference
+                pnode->fMsgHandQueued = true;
+                vMsgHandQueue.push_back(pnode);
+                condMsgHand.notify_one();
+            }
+            else
                 pnode->Release();
         }
-
-        if (fSleep)
-            MilliSleep(100);
     }
 }
 
@@ -1807,6 +2101,7 @@ bool BindListenNativeI2P(SOCKET& hSocket)
     hSocket = I2PSession::Instance().accept(false);
     if (!SetSocketOptions(hSocket) || hSocket == INVALID_SOCKET)
         return false;
+    RegisterListenSocket(hSocket);
     CService addrBind(I2PSession::Instance().getMyDestination().pub, 0);
     if (addrBind.IsRoutable() && fDiscover)
         AddLocal(addrBind, LOCAL_BIND);
@@ -1964,6 +2259,21 @@ void static Discover()
         NewThread(ThreadGetMyExternalIP, NULL);
 }
 
+bool InitSocketPoll()
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+    {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1)
+            printf("Error: epoll_create1 failed: %d, falling back to select()\n", errno);
+    }
+    return hEpoll != -1;
+#else
+    return false;
+#endif
+}
+
 void StartNode(boost::thread_group& threadGroup)
 {
     if (semOutbound == NULL) {
@@ -1975,6 +2285,8 @@ void StartNode(boost::thread_group& threadGroup)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+    InitSocketPoll();
+
     Discover();
 
     //
@@ -2001,7 +2313,8 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -2042,6 +2355,10 @@ public:
             if (hI2PListenSocket != INVALID_SOCKET)
                 if (closesocket(hI2PListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hI2PListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -2090,8 +2407,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // peers asking for it all get queued the same shared copy
+        mapRelay.insert(std::make_pair(inv, CNetPayloadRef(new CNetPayload(ss))));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2103,8 +2421,14 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         if (pnode->pfilter)
         {
             if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
+            {
                 pnode->PushInventory(inv);
+                ScheduleMessageHandler(pnode);
+            }
         } else
+        {
             pnode->PushInventory(inv);
+            ScheduleMessageHandler(pnode);
+        }
     }
 }
@@ -6,6 +6,7 @@
 #define BITCOIN_NET_H
 
 #include <deque>
+#include <memory>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
 #include <openssl/rand.h>
@@ -31,6 +32,9 @@ extern int nBestHeight;
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 8;
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -41,9 +45,14 @@ CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
+// Set up the epoll socket reactor; false if sockets are polled with select(), and so
+// limited to descriptors below FD_SETSIZE
+bool InitSocketPoll();
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void ScheduleMessageHandler(CNode *pnode);
+void ReleaseSyncNode(CNode *pnode);
 
 bool BindListenNativeI2P();
 bool BindListenNativeI2P(SOCKET& hSocket);
@@ -77,16 +86,86 @@ void SetReachable(enum Network net, bool fFlag = true);
 CAddress GetLocalAddress(const CNetAddr *paddrPeer = NULL);
 
 
+/** Serialized payload of a message that is queued unchanged to many peers, like a
+ *  relayed transaction. Immutable once created and shared by reference, so its
+ *  checksum is computed once and it is never copied into the send queues. */
+class CNetPayload
+{
+public:
+    std::vector<char> vch; // public data, not zeroed on free
+    unsigned int nChecksum;
+
+    explicit CNetPayload(const CDataStream& ss) : vch(ss.begin(), ss.end())
+    {
+        uint256 hash = Hash(vch.begin(), vch.end());
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    }
+};
+typedef std::shared_ptr<const CNetPayload> CNetPayloadRef;
+
+/** Recycles the storage of send and receive buffers. What goes over the wire is
+ *  public, so reusing a buffer also saves the zeroing its allocator does on free. */
+class CNetBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree;
+
+public:
+    enum
+    {
+        MAX_FREE_BUFFERS = 256,
+        MAX_BUFFER_CAPACITY = 64 * 1024, // larger buffers are freed
+    };
+
+    // Give the empty stream recycled storage
+    void Get(CDataStream& ss)
+    {
+        CSerializeData vch;
+        {
+            LOCK(cs);
+            if (vFree.empty())
+                return;
+            vFree.back().swap(vch);
+            vFree.pop_back();
+        }
+        ss.Swap(vch);
+    }
+
+    // Take the storage of vch, leaving it empty
+    void Put(CSerializeData& vch)
+    {
+        if (vch.capacity() == 0 || vch.capacity() > MAX_BUFFER_CAPACITY)
+            return;
+        LOCK(cs);
+        if (vFree.size() >= MAX_FREE_BUFFERS)
+            return;
+        vFree.push_back(CSerializeData());
+        vFree.back().swap(vch);
+        vFree.back().clear();
+    }
+
+    void Put(CDataStream& ss)
+    {
+        CSerializeData vch;
+        ss.GetAndClear(vch);
+        Put(vch);
+    }
+};
+extern CNetBufferPool netBufferPool;
+
+
 extern bool fDiscover;
 extern uint64 nLocalServices;
 extern uint64 nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
 extern int nI2PNodeCount;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetPayloadRef> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
@@ -155,6 +234,22 @@ public:
 };
 
 
+/** A message in the send queue: serialized bytes, optionally followed by a region
+ *  of a memory-mapped file or a shared payload that is sent from where it lies */
+class CSendMessage
+{
+public:
+    CSerializeData vch;
+    std::shared_ptr<const void> pholder; // keeps pchTail valid
+    const char* pchTail;
+    size_t nTail;
+
+    CSendMessage() : pchTail(NULL), nTail(0) {}
+
+    size_t size() const { return vch.size() + nTail; }
+};
+
+
 /** Information about a peer */
 class CNode
 {
@@ -167,7 +262,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -209,13 +304,35 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    static int64 nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
 public:
+    int64 nId; // never given to another node, unlike the address of a CNode
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
     bool fStartSync;
 
+    // headers-first sync
+    bool fSyncHeaders; // this is the sync node and has more headers for us
+    bool fSyncFailed; // its headers did not connect or came too late, it is not picked as sync node again
+    int64 nHeadersRequestTime; // when the outstanding getheaders was sent, 0 if none
+    std::set<uint256> setBlocksInFlight; // blocks of the header chain requested from it
+    int64 nBlockDownloadBackoff; // no blocks are requested from it before then, after it stalled
+
+    // socket readiness, see ThreadSocketHandler
+    bool fPollRegistered; // the socket is in the epoll set, guarded by cs_vSend
+    bool fPollSend; // EPOLLOUT is asked for, guarded by cs_vSend
+    bool fSocketReadable; // latched until a recv comes up short, only used by the socket thread
+    bool fSocketWritable;
+
+    // message handler pool, guarded by its queue mutex
+    bool fMsgHandQueued; // waiting in the queue, which holds a reference
+    bool fMsgHandRunning; // a worker has it
+    bool fMsgHandAgain; // more work came up while a worker had it
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
@@ -261,9 +378,24 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        fSyncHeaders = false;
+        fSyncFailed = false;
+        nHeadersRequestTime = 0;
+        nBlockDownloadBackoff = 0;
+        fPollRegistered = false;
+        fPollSend = false;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        fMsgHandQueued = false;
+        fMsgHandRunning = false;
+        fMsgHandAgain = false;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
+        {
+            LOCK(cs_nLastNodeId);
+            nId = ++nLastNodeId;
+        }
         setInventoryKnown.max_size(SendBufferSize() / 1000);
         pfilter = new CBloomFilter();
 
@@ -442,7 +574,10 @@ public:
     }
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
-    void EndMessage() UNLOCK_FUNCTION(cs_vSend)
+    // A message can instead carry a mapped region or shared payload as its whole
+    // payload, whose checksum the caller knows, see PushMappedMessage and PushPayload.
+    void EndMessage(const std::shared_ptr<const void> &pholder = std::shared_ptr<const void>(),
+                    const char* pchTail = NULL, size_t nTail = 0, unsigned int nTailChecksum = 0) UNLOCK_FUNCTION(cs_vSend)
     {
         if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
         {
@@ -455,13 +590,18 @@ public:
             return;
 
         // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
+        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE + nTail;
         memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
 
         // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        unsigned int nChecksum = nTailChecksum;
+        if (pchTail == NULL)
+        {
+            uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+            memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        }
+        else
+            assert(ssSend.size() == CMessageHeader::HEADER_SIZE);
         assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
         memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
@@ -469,8 +609,12 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
+        std::deque<CSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMessage());
+        ssSend.GetAndClear((*it).vch);
+        netBufferPool.Get(ssSend);
+        (*it).pholder = pholder;
+        (*it).pchTail = pchTail;
+        (*it).nTail = nTail;
         nSendSize += (*it).size();
 
         // If write queue empty, attempt "optimistic write"
@@ -482,6 +626,36 @@ public:
 
     void PushVersion();
 
+    // Send nSize bytes at pch as they are, they must stay valid while pfile is held
+    void PushMappedMessage(const char* pszCommand, const std::shared_ptr<const CMappedFile> &pfile,
+                           const char* pch, unsigned int nSize, unsigned int nChecksum)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            EndMessage(pfile, pch, nSize, nChecksum);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
+    void PushPayload(const char* pszCommand, const CNetPayloadRef &payload)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            EndMessage(payload, payload->vch.data(), payload->vch.size(), payload->nChecksum);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -0,0 +1,203 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_POOLEDMAP_H
+#define BITCOIN_POOLEDMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+#include <type_traits>
+
+/** STL-like hash map with open addressing (linear probing, backward shift deletion).
+ *  Elements live in chunks of a pool and are never moved while they are in the map,
+ *  so pointers and references to them stay valid until they are erased.
+ *  Hash must return a well mixed 64 bit value, the map does not scramble it further.
+ */
+template <typename K, typename V, typename Hash> class pooledmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+
+protected:
+    struct slot
+    {
+        uint64_t nHash;
+        value_type *p; // NULL if empty
+    };
+
+    union node
+    {
+        node *pnext;
+        typename std::aligned_storage<sizeof(value_type), std::alignment_of<value_type>::value>::type data;
+    };
+
+    static const size_type nChunkSize = 256;
+
+    std::vector<slot> vSlots; // size is zero or a power of two
+    std::vector<node*> vChunks;
+    node *pfree;
+    size_type nSize;
+    Hash hasher;
+
+    value_type *alloc(const K& k)
+    {
+        if (pfree == NULL)
+        {
+            node *chunk = new node[nChunkSize];
+            vChunks.push_back(chunk);
+            for (size_type i = 0; i < nChunkSize; i++)
+            {
+                chunk[i].pnext = pfree;
+                pfree = &chunk[i];
+            }
+        }
+        node *n = pfree;
+        pfree = n->pnext;
+        return new (&n->data) value_type(k, V());
+    }
+
+    void release(value_type *p)
+    {
+        p->~value_type();
+        node *n = reinterpret_cast<node*>(p);
+        n->pnext = pfree;
+        pfree = n;
+    }
+
+    size_type lookup(const K& k, uint64_t nHash) const
+    {
+        size_type nMask = vSlots.size() - 1;
+        for (size_type i = nHash & nMask; ; i = (i + 1) & nMask)
+        {
+            const slot &s = vSlots[i];
+            if (s.p == NULL || (s.nHash == nHash && s.p->first == k))
+                return i;
+        }
+    }
+
+    void rehash(size_type nNewSize)
+    {
+        std::vector<slot> vOld(nNewSize);
+        vOld.swap(vSlots);
+        size_type nMask = nNewSize - 1;
+        for (typename std::vector<slot>::const_iterator it = vOld.begin(); it != vOld.end(); ++it)
+        {
+            if (it->p == NULL)
+                continue;
+            size_type i = it->nHash & nMask;
+            while (vSlots[i].p != NULL)
+                i = (i + 1) & nMask;
+            vSlots[i] = *it;
+        }
+    }
+
+public:
+    template <typename T, typename S> class iterator_base
+    {
+        friend class pooledmap;
+        template <typename T2, typename S2> friend class iterator_base;
+        S *ps;
+        S *pend;
+        iterator_base(S *psIn, S *pendIn) : ps(psIn), pend(pendIn) { skip(); }
+        void skip() { while (ps != pend && ps->p == NULL) ps++; }
+    public:
+        iterator_base() : ps(NULL), pend(NULL) {}
+        template <typename T2, typename S2> iterator_base(const iterator_base<T2, S2> &it) : ps(it.ps), pend(it.pend) {}
+        T &operator*() const { return *ps->p; }
+        T *operator->() const { return ps->p; }
+        iterator_base &operator++() { ps++; skip(); return *this; }
+        bool operator==(const iterator_base &it) const { return ps == it.ps; }
+        bool operator!=(const iterator_base &it) const { return ps != it.ps; }
+    };
+    typedef iterator_base<value_type, slot> iterator;
+    typedef iterator_base<const value_type, const slot> const_iterator;
+
+    pooledmap(const Hash &hasherIn = Hash()) : pfree(NULL), nSize(0), hasher(hasherIn) {}
+    ~pooledmap() { clear(); }
+
+    iterator begin() { return iterator(vSlots.empty() ? NULL : &vSlots[0], vSlots.empty() ? NULL : &vSlots[0] + vSlots.size()); }
+    iterator end() { return iterator(vSlots.empty() ? NULL : &vSlots[0] + vSlots.size(), vSlots.empty() ? NULL : &vSlots[0] + vSlots.size()); }
+    const_iterator begin() const { return const_iterator(vSlots.empty() ? NULL : &vSlots[0], vSlots.empty() ? NULL : &vSlots[0] + vSlots.size()); }
+    const_iterator end() const { return const_iterator(vSlots.empty() ? NULL : &vSlots[0] + vSlots.size(), vSlots.empty() ? NULL : &vSlots[0] + vSlots.size()); }
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    // the element for k, or NULL
+    value_type *find(const K& k)
+    {
+        if (nSize == 0)
+            return NULL;
+        return vSlots[lookup(k, hasher(k))].p;
+    }
+
+    // the element for k and whether it was inserted, new elements have a default constructed value
+    std::pair<value_type*, bool> insert(const K& k)
+    {
+        if ((nSize + 1) * 4 > vSlots.size() * 3)
+            rehash(vSlots.empty() ? 16 : vSlots.size() * 2);
+        uint64_t nHash = hasher(k);
+        slot &s = vSlots[lookup(k, nHash)];
+        if (s.p != NULL)
+            return std::make_pair(s.p, false);
+        s.nHash = nHash;
+        s.p = alloc(k);
+        nSize++;
+        return std::make_pair(s.p, true);
+    }
+
+    bool erase(const K& k)
+    {
+        if (nSize == 0)
+            return false;
+        size_type nMask = vSlots.size() - 1;
+        size_type i = lookup(k, hasher(k));
+        if (vSlots[i].p == NULL)
+            return false;
+        release(vSlots[i].p);
+        nSize--;
+        // shift back the following elements of the cluster that may not live past the hole
+        for (size_type j = (i + 1) & nMask; vSlots[j].p != NULL; j = (j + 1) & nMask)
+        {
+            size_type nHome = vSlots[j].nHash & nMask;
+            if (((j - nHome) & nMask) >= ((j - i) & nMask))
+            {
+                vSlots[i] = vSlots[j];
+                i = j;
+            }
+        }
+        vSlots[i].p = NULL;
+        return true;
+    }
+
+    // destroys all elements and gives the memory back
+    void clear()
+    {
+        for (typename std::vector<slot>::iterator it = vSlots.begin(); it != vSlots.end(); ++it)
+            if (it->p != NULL)
+                it->p->~value_type();
+        std::vector<slot>().swap(vSlots);
+        for (typename std::vector<node*>::iterator it = vChunks.begin(); it != vChunks.end(); ++it)
+            delete [] *it;
+        std::vector<node*>().swap(vChunks);
+        pfree = NULL;
+        nSize = 0;
+    }
+
+    // bytes held by the table and the pool, not counting what the elements allocate themselves
+    size_t memory_usage() const
+    {
+        return vSlots.capacity() * sizeof(slot) + vChunks.capacity() * sizeof(node*) +
+               vChunks.size() * nChunkSize * sizeof(node);
+    }
+
+private:
+    pooledmap(const pooledmap&);
+    pooledmap &operator=(const pooledmap&);
+};
+
+#endif
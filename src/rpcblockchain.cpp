@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -186,22 +187,115 @@ Value getblock(const Array& params, bool fHelp)
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
-            "Returns statistics about the unspent transaction output set.");
+            "gettxoutsetinfo [verify=false]\n"
+            "Returns statistics about the unspent transaction output set.\n"
+            "They are maintained as blocks are connected, so this returns at once.\n"
+            "With verify, the coin database is read in full on all cores and\n"
+            "\"verified\" tells whether it matches the maintained statistics.");
+
+    bool fVerify = false;
+    if (params.size() > 0)
+        fVerify = params[0].get_bool();
 
     Object ret;
 
     CCoinsStats stats;
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (boost::int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (boost::int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (boost::int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    bool fKnown = pcoinsTip->GetStats(stats);
+    if (fVerify || !fKnown) {
+        // the scan reads the database, so it must have everything the tip has
+        if (!pcoinsTip->Flush())
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to flush the coin database");
+        CCoinsStats statsScan;
+        if (!pcoinsdbview->ScanStats(statsScan, boost::thread::hardware_concurrency()))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the coin database");
+        if (!fKnown) {
+            // a chainstate of an older version, maintain them from here on
+            if (!pcoinsdbview->WriteStats(statsScan))
+                throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to write the coin database");
+        } else {
+            pcoinsTip->GetStats(stats);
+            ret.push_back(Pair("verified", statsScan == stats));
+        }
+        stats = statsScan;
+    }
+
+    ret.push_back(Pair("height", (boost::int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (boost::int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", (boost::int64_t)stats.nSerializedSize));
+    ret.push_back(Pair("hash_set", stats.hashSet.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    return ret;
+}
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns statistics about the signature cache.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("bytes", (boost::int64_t)stats.nBytes));
+    ret.push_back(Pair("capacity", (boost::int64_t)stats.nCapacity));
+    ret.push_back(Pair("entries", (boost::int64_t)stats.nEntries));
+    ret.push_back(Pair("hits", (boost::int64_t)stats.nHits));
+    ret.push_back(Pair("misses", (boost::int64_t)stats.nMisses));
+    ret.push_back(Pair("inserts", (boost::int64_t)stats.nInserts));
+    ret.push_back(Pair("evictions", (boost::int64_t)stats.nEvictions));
+    return ret;
+}
+
+// LevelDB settings, disk usage per kind of key (named by vKeys) and compaction statistics
+static Object DBStatsToJSON(CLevelDB &db, const vector<pair<char, string> > &vKeys)
+{
+    const CLevelDBProfile &profile = db.GetProfile();
+    Object settings;
+    settings.push_back(Pair("blockcache", (boost::int64_t)profile.nBlockCache));
+    settings.push_back(Pair("writebuffer", (boost::int64_t)profile.nWriteBuffer));
+    settings.push_back(Pair("blocksize", (boost::int64_t)profile.nBlockSize));
+    settings.push_back(Pair("compression", profile.fCompression));
+    settings.push_back(Pair("maxopenfiles", profile.nMaxOpenFiles));
+    settings.push_back(Pair("bloombits", profile.nBloomBits));
+
+    Object sizes;
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        sizes.push_back(Pair(vKeys[i].second, (boost::int64_t)db.GetApproximateSize(vKeys[i].first)));
+
+    Object ret;
+    ret.push_back(Pair("profile", settings));
+    ret.push_back(Pair("approximate_size", (boost::int64_t)db.GetApproximateSize()));
+    ret.push_back(Pair("approximate_sizes", sizes));
+    ret.push_back(Pair("stats", db.GetProperty("leveldb.stats")));
+    return ret;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns the settings, estimated disk usage and LevelDB statistics of the\n"
+            "coins (chainstate) and block index databases.");
+
+    Object ret;
+    if (pcoinsdbview) {
+        vector<pair<char, string> > vKeys;
+        vKeys.push_back(make_pair('c', string("coins")));
+        ret.push_back(Pair("chainstate", DBStatsToJSON(pcoinsdbview->GetDB(), vKeys)));
+    }
+    if (pblocktree) {
+        vector<pair<char, string> > vKeys;
+        vKeys.push_back(make_pair('b', string("blockindex")));
+        vKeys.push_back(make_pair('f', string("blockfiles")));
+        vKeys.push_back(make_pair('t', string("txindex")));
+        ret.push_back(Pair("blockindex", DBStatsToJSON(*pblocktree, vKeys)));
     }
     return ret;
 }
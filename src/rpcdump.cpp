@@ -58,14 +58,18 @@ Value importprivkey(const Array& params, bool fHelp)
     CPubKey pubkey = key.GetPubKey();
     CKeyID vchAddress = pubkey.GetID();
     {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
+        LOCK(cs_main);
+        {
+            LOCK(pwalletMain->cs_wallet);
 
-        pwalletMain->MarkDirty();
-        pwalletMain->SetAddressBookName(vchAddress, strLabel);
+            pwalletMain->MarkDirty();
+            pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
-        if (!pwalletMain->AddKeyPubKey(key, pubkey))
-            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+            if (!pwalletMain->AddKeyPubKey(key, pubkey))
+                throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+        }
 
+        // the rescan takes the wallet lock one block at a time
         if (fRescan) {
             pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
             pwalletMain->ReacceptWalletTransactions();
@@ -75,6 +79,31 @@ Value importprivkey(const Array& params, bool fHelp)
     return Value::null;
 }
 
+Value rescanwallet(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "rescanwallet [start=0]\n"
+            "Rescans the block chain for wallet transactions from block height <start>,\n"
+            "or from the time <start> if it is a unix timestamp (500000000 or more).\n"
+            "Returns the number of transactions found or updated.");
+
+    int64 nStart = 0;
+    if (params.size() > 0)
+        nStart = params[0].get_int64();
+    if (nStart < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative start");
+
+    LOCK(cs_main);
+    CBlockIndex *pindexStart = nStart < LOCKTIME_THRESHOLD ? FindBlockByHeight(nStart) : FindBlockByTime(nStart);
+    if (pindexStart == NULL)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Start is past the best block");
+
+    int nFound = pwalletMain->ScanForWalletTransactions(pindexStart, true);
+    pwalletMain->ReacceptWalletTransactions();
+    return nFound;
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -3,7 +3,10 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <boost/thread/tss.hpp>
+#include <atomic>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -17,7 +20,8 @@ using namespace boost;
 #include "util.h"
 #include "Gost.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSignatureHashCache *psighashcache = NULL, bool fDeferrable = false);
 
 
 
@@ -290,7 +294,8 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHashCache *psighashcache)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -844,7 +849,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache, true);
 
                     popstack(stack);
                     popstack(stack);
@@ -906,7 +911,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
 
                         if (fOk) {
                             isig++;
@@ -1021,71 +1026,367 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
+    ss.reserve(::GetSerializeSize(txTmp, SER_GETHASH, 0) + sizeof(nHashType));
     ss << txTmp << nHashType;
     return ss.GetHash();
 }
 
 
+CSignatureHashCache::CSignatureHashCache(const CTransaction &txToIn) : txTo(txToIn)
+{
+    CDataStream ssInputs(SER_GETHASH, 0);
+    ssInputs.reserve(txTo.vin.size() * 40);
+    BOOST_FOREACH(const CTxIn &txin, txTo.vin)
+        ssInputs << txin.prevout << txin.nSequence;
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+    vOutputPos.reserve(txTo.vout.size() + 1);
+    unsigned int nPos = GetSizeOfCompactSize(txTo.vout.size());
+    BOOST_FOREACH(const CTxOut &txout, txTo.vout) {
+        vOutputPos.push_back(nPos);
+        nPos += ::GetSerializeSize(txout, SER_GETHASH, 0);
+    }
+    vOutputPos.push_back(nPos);
+}
+
+// Writes what SignatureHash() serializes from its modified copy of the transaction
+uint256 CSignatureHashCache::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= txTo.vin.size())
+    {
+        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
+    }
+    bool fSingle = (nHashType & 0x1f) == SIGHASH_SINGLE;
+    bool fNone = (nHashType & 0x1f) == SIGHASH_NONE;
+    if (fSingle && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
+    bool fAnyoneCanPay = nHashType & SIGHASH_ANYONECANPAY;
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    static const unsigned char vchNullOutput[9] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+    static const unsigned char vchZero[4] = { 0, 0, 0, 0 };
+    unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss.reserve(vchInputs.size() + nInputs + ::GetSerializeSize(scriptCode, SER_GETHASH, 0) +
+               vchOutputs.size() + (fSingle ? nIn * sizeof(vchNullOutput) : 0) + 32);
+    ss << txTo.nVersion;
+
+    // inputs: only the one being signed has a script, the others are blank
+    WriteCompactSize(ss, nInputs);
+    for (unsigned int i = fAnyoneCanPay ? nIn : 0; i < (fAnyoneCanPay ? nIn + 1 : txTo.vin.size()); i++)
+    {
+        const char *pchInput = (const char*)&vchInputs[i * 40];
+        ss.write(pchInput, 36);
+        if (i == nIn) {
+            ss << scriptCode;
+            ss.write(pchInput + 36, 4);
+        } else {
+            WriteCompactSize(ss, 0);
+            // let the others update at will
+            ss.write((fNone || fSingle) ? (const char*)vchZero : pchInput + 36, 4);
+        }
+    }
+
+    // outputs: none, the one at the same index as the input, or all
+    if (fNone) {
+        WriteCompactSize(ss, 0);
+    } else if (fSingle) {
+        WriteCompactSize(ss, nIn + 1);
+        for (unsigned int i = 0; i < nIn; i++)
+            ss.write((const char*)vchNullOutput, sizeof(vchNullOutput));
+        ss.write((const char*)&vchOutputs[vOutputPos[nIn]], vOutputPos[nIn + 1] - vOutputPos[nIn]);
+    } else {
+        ss.write((const char*)&vchOutputs[0], vchOutputs.size());
+    }
+
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
+
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are 128-bit fingerprints of a salted SHA256 of (signature hash,
+// signature, public key) in a fixed table of 64-byte buckets holding 3 each.
+// Every fingerprint has two candidate buckets, the second one derived from the
+// first and the fingerprint itself, so a full bucket can move an entry to its
+// other bucket (cuckoo filter). Lookups don't lock: each bucket has a sequence
+// number which writers make odd while they modify it, and readers retry if it
+// changed under them.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const int nSlots = 3;
+    static const int nMaxKicks = 8;
+
+    struct alignas(64) Bucket {
+        std::atomic<uint64_t> nSeq;
+        std::atomic<uint64_t> vKey[nSlots][2]; // 0 is an empty slot
+        uint64_t pad;
+    };
+
+    unsigned char *pmem;
+    Bucket *pbuckets;
+    uint64_t nMask; // number of buckets - 1
+    unsigned char salt[32];
+
+    // counters on their own cache line
+    struct alignas(64) Counters {
+        std::atomic<uint64_t> nHits, nMisses, nInserts, nEvictions, nEntries;
+    };
+    Counters counters;
+
+    void ComputeKey(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey, uint64_t key[2], uint64_t &nBucket) const
+    {
+        unsigned char digest[32];
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, salt, sizeof(salt));
+        SHA256_Update(&ctx, hash.begin(), 32);
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        SHA256_Final(digest, &ctx);
+        uint64_t d[3];
+        memcpy(d, digest, sizeof(d));
+        key[0] = d[0] | 1;
+        key[1] = d[1];
+        nBucket = d[2] & nMask;
+    }
+
+    uint64_t AltBucket(uint64_t nBucket, const uint64_t key[2]) const
+    {
+        return (nBucket ^ ((key[1] * 0x9E3779B97F4A7C15ULL) >> 17)) & nMask;
+    }
+
+    bool Contains(const Bucket &bucket, const uint64_t key[2]) const
+    {
+        while (true)
+        {
+            uint64_t nSeq = bucket.nSeq.load(std::memory_order_acquire);
+            if (nSeq & 1)
+                continue; // being written
+            bool fFound = false;
+            for (int i = 0; i < nSlots; i++)
+                if (bucket.vKey[i][0].load(std::memory_order_relaxed) == key[0] &&
+                    bucket.vKey[i][1].load(std::memory_order_relaxed) == key[1])
+                    fFound = true;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (bucket.nSeq.load(std::memory_order_relaxed) == nSeq)
+                return fFound;
+        }
+    }
+
+    uint64_t Lock(Bucket &bucket)
+    {
+        uint64_t nSeq = bucket.nSeq.load(std::memory_order_relaxed);
+        while ((nSeq & 1) || !bucket.nSeq.compare_exchange_weak(nSeq, nSeq + 1, std::memory_order_acquire))
+            nSeq = bucket.nSeq.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return nSeq + 2;
+    }
+
+    // Store key into an empty slot, or replace slot nVictim and return the
+    // replaced key in key. Returns true if nothing was replaced.
+    bool Store(Bucket &bucket, uint64_t key[2], int nVictim)
+    {
+        uint64_t nSeq = Lock(bucket);
+        bool fStored = false;
+        for (int i = 0; i < nSlots && !fStored; i++)
+            if (bucket.vKey[i][0].load(std::memory_order_relaxed) == 0)
+            {
+                bucket.vKey[i][0].store(key[0], std::memory_order_relaxed);
+                bucket.vKey[i][1].store(key[1], std::memory_order_relaxed);
+                fStored = true;
+            }
+        if (!fStored && nVictim >= 0)
+        {
+            uint64_t victim[2] = { bucket.vKey[nVictim][0].load(std::memory_order_relaxed),
+                                   bucket.vKey[nVictim][1].load(std::memory_order_relaxed) };
+            bucket.vKey[nVictim][0].store(key[0], std::memory_order_relaxed);
+            bucket.vKey[nVictim][1].store(key[1], std::memory_order_relaxed);
+            key[0] = victim[0];
+            key[1] = victim[1];
+        }
+        bucket.nSeq.store(nSeq, std::memory_order_release);
+        return fStored;
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache() : pmem(NULL), pbuckets(NULL), nMask(0)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        counters.nHits = 0;
+        counters.nMisses = 0;
+        counters.nInserts = 0;
+        counters.nEvictions = 0;
+        counters.nEntries = 0;
+
+        // DoS prevention: the table size is fixed in megabytes, the largest power of
+        // two number of buckets that fits. At ~200k entries per 4MB, the default holds
+        // well over the 20,000 signature operations of a block. -maxsigcachesize keeps
+        // its old meaning, a number of entries, and is turned into the size holding them.
+        static const int64 nMaxCacheMB = 16384;
+        int64 nMaxCacheSize;
+        if (mapArgs.count("-maxsigcachesize"))
+        {
+            int64 nMaxEntries = std::min(GetArg("-maxsigcachesize", 50000), (nMaxCacheMB << 20) / (int64)sizeof(Bucket) * nSlots);
+            nMaxCacheSize = (nMaxEntries + nSlots - 1) / nSlots * (int64)sizeof(Bucket);
+        }
+        else
+            nMaxCacheSize = std::min(GetArg("-sigcachemb", 16), nMaxCacheMB) << 20;
+        if (nMaxCacheSize < (int64)sizeof(Bucket))
+            return;
+        uint64_t nBuckets = 1;
+        while (nBuckets * 2 * sizeof(Bucket) <= (uint64_t)nMaxCacheSize)
+            nBuckets *= 2;
+        pmem = new unsigned char[nBuckets * sizeof(Bucket) + 63];
+        pbuckets = (Bucket*)(((uintptr_t)pmem + 63) & ~(uintptr_t)63);
+        for (uint64_t i = 0; i < nBuckets; i++)
+        {
+            pbuckets[i].nSeq = 0;
+            for (int j = 0; j < nSlots; j++)
+                pbuckets[i].vKey[j][0] = pbuckets[i].vKey[j][1] = 0;
+        }
+        nMask = nBuckets - 1;
+        RAND_bytes(salt, sizeof(salt));
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
+    ~CSignatureCache()
+    {
+        delete[] pmem;
+    }
+
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        if (!pbuckets)
+            return false;
+        uint64_t key[2], nBucket;
+        ComputeKey(hash, vchSig, pubKey, key, nBucket);
+        if (Contains(pbuckets[nBucket], key) || Contains(pbuckets[AltBucket(nBucket, key)], key)) {
+            counters.nHits.fetch_add(1, std::memory_order_relaxed);
             return true;
+        }
+        counters.nMisses.fetch_add(1, std::memory_order_relaxed);
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        if (!pbuckets)
+            return;
+        uint64_t key[2], nBucket;
+        ComputeKey(hash, vchSig, pubKey, key, nBucket);
+        uint64_t nAltBucket = AltBucket(nBucket, key);
+        if (Contains(pbuckets[nBucket], key) || Contains(pbuckets[nAltBucket], key))
+            return;
+        counters.nInserts.fetch_add(1, std::memory_order_relaxed);
+        if (Store(pbuckets[nBucket], key, -1) || Store(pbuckets[nAltBucket], key, -1)) {
+            counters.nEntries.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // Both buckets full: push entries to their other bucket a few times, then
+        // drop the last one displaced. The victim slot is picked from the salted key,
+        // so an attacker can't choose which entries get pushed out.
+        nBucket = nAltBucket;
+        for (int nKick = 0; nKick < nMaxKicks; nKick++) {
+            if (Store(pbuckets[nBucket], key, (int)(key[1] % nSlots))) {
+                counters.nEntries.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            nBucket = AltBucket(nBucket, key);
         }
+        counters.nEvictions.fetch_add(1, std::memory_order_relaxed);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(CSignatureCacheStats &stats) const
+    {
+        stats.nBytes = pbuckets ? (nMask + 1) * sizeof(Bucket) : 0;
+        stats.nCapacity = pbuckets ? (nMask + 1) * nSlots : 0;
+        stats.nEntries = counters.nEntries.load(std::memory_order_relaxed);
+        stats.nHits = counters.nHits.load(std::memory_order_relaxed);
+        stats.nMisses = counters.nMisses.load(std::memory_order_relaxed);
+        stats.nInserts = counters.nInserts.load(std::memory_order_relaxed);
+        stats.nEvictions = counters.nEvictions.load(std::memory_order_relaxed);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+// created on first use, after the command line is parsed
+static CSignatureCache &GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats &stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
+
+
+static void NoCleanup(CSignatureBatch *) {}
+static boost::thread_specific_ptr<CSignatureBatch> pbatchActive(NoCleanup);
+
+CSignatureBatch::CSignatureBatch() : nTag(0)
+{
+    assert(pbatchActive.get() == NULL);
+    pbatchActive.reset(this);
+}
+
+CSignatureBatch::~CSignatureBatch()
+{
+    if (pbatchActive.get() == this)
+        pbatchActive.reset();
+}
+
+CSignatureBatch *CSignatureBatch::GetActive()
+{
+    return pbatchActive.get();
+}
+
+void CSignatureBatch::Add(const CPubKey &pubkey, const uint256 &hash, const std::vector<unsigned char> &vchSig, int flags)
+{
+    vPubKey.push_back(pubkey);
+    vHash.push_back(hash);
+    vSig.push_back(vchSig);
+    vTag.push_back(nTag);
+    vFlags.push_back(flags);
+}
+
+bool CSignatureBatch::Verify(std::vector<bool> &vfTagOk)
+{
+    if (pbatchActive.get() == this)
+        pbatchActive.reset();
+    if (vSig.empty())
+        return true;
+
+    std::vector<bool> vfValid;
+    bool fAllValid = CPubKey::VerifyBatch(vPubKey, vHash, vSig, vfValid);
+    for (unsigned int i = 0; i < vSig.size(); i++)
+    {
+        if (!vfValid[i])
+            vfTagOk[vTag[i]] = false;
+        else if (!(vFlags[i] & SCRIPT_VERIFY_NOCACHE))
+            GetSignatureCache().Set(vHash[i], vSig[i], vPubKey[i]);
+    }
+    return fAllValid;
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSignatureHashCache *psighashcache, bool fDeferrable)
+{
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1100,16 +1401,24 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighashcache ? psighashcache->SignatureHash(scriptCode, nIn, nHashType) :
+                                      SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    if (GetSignatureCache().Get(sighash, vchSig, pubkey))
+        return true;
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    CSignatureBatch *pbatch = fDeferrable ? CSignatureBatch::GetActive() : NULL;
+    if (pbatch)
+    {
+        pbatch->Add(pubkey, sighash, vchSig, flags);
         return true;
+    }
 
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        GetSignatureCache().Set(sighash, vchSig, pubkey);
 
     return true;
 }
@@ -1476,14 +1785,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashCache *psighashcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighashcache))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighashcache))
         return false;
     if (stack.empty())
         return false;
@@ -1506,7 +1815,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighashcache))
             return false;
         if (stackCopy.empty())
             return false;
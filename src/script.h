@@ -668,7 +668,26 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/** Serialized parts of a transaction that signature hashes are built from,
+ *  computed once and shared by all of its inputs. SignatureHash() then costs
+ *  one pass over the transaction's bytes per input instead of a copy of the
+ *  transaction, and gives the same digests as the free SignatureHash().
+ *  The transaction must outlive the cache.
+ */
+class CSignatureHashCache
+{
+private:
+    const CTransaction &txTo;
+    std::vector<unsigned char> vchInputs;      // prevout and nSequence of every input, 40 bytes each
+    std::vector<unsigned char> vchOutputs;     // vout as serialized, with its size
+    std::vector<unsigned int> vOutputPos;      // start of every output in vchOutputs, and the end
+
+public:
+    CSignatureHashCache(const CTransaction &txToIn);
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *psighashcache = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -678,7 +697,54 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *psighashcache = NULL);
+
+/** Signature cache statistics */
+struct CSignatureCacheStats
+{
+    uint64 nBytes;      // table size
+    uint64 nCapacity;   // entries the table can hold
+    uint64 nEntries;    // entries in the table
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nInserts;
+    uint64 nEvictions;  // inserts dropped after displacing entries
+};
+
+void GetSignatureCacheStats(CSignatureCacheStats &stats);
+
+/** Signatures deferred for batch verification.
+ *  While a batch is alive, OP_CHECKSIG(VERIFY) on the same thread doesn't verify
+ *  signatures missing from the signature cache: they are taken as valid and recorded
+ *  together with the current tag. Verify() then checks them all at once. A script
+ *  evaluated this way is only known to be valid if it succeeded and none of the
+ *  signatures recorded under its tag failed; otherwise it must be evaluated again
+ *  without a batch.
+ */
+class CSignatureBatch
+{
+private:
+    std::vector<CPubKey> vPubKey;
+    std::vector<uint256> vHash;
+    std::vector<std::vector<unsigned char> > vSig;
+    std::vector<unsigned int> vTag;
+    std::vector<int> vFlags;
+    unsigned int nTag;
+
+public:
+    CSignatureBatch();
+    ~CSignatureBatch();
+
+    // batch active on the calling thread, or NULL
+    static CSignatureBatch *GetActive();
+
+    void SetTag(unsigned int nTagIn) { nTag = nTagIn; }
+    void Add(const CPubKey &pubkey, const uint256 &hash, const std::vector<unsigned char> &vchSig, int flags);
+
+    // Stop recording and verify the recorded signatures. vfTagOk[tag] is cleared
+    // for the tag of every invalid one; returns true if all are valid.
+    bool Verify(std::vector<bool> &vfTagOk);
+};
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
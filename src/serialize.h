@@ -1089,6 +1089,12 @@ public:
         vch.swap(data);
         CSerializeData().swap(vch);
     }
+
+    // Exchange the storage with data, e.g. to hand the stream a recycled buffer
+    void Swap(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
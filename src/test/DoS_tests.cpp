@@ -264,10 +264,14 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     // 2.8GHz machine, -g build: Sign takes ~760ms,
     // uncached Verify takes ~250ms, cached Verify takes ~50ms
     // (for 100 single-signature inputs)
+    CSignatureCacheStats stats1, stats2;
+    GetSignatureCacheStats(stats1);
     mst1 = boost::posix_time::microsec_clock::local_time();
     for (unsigned int i = 0; i < 5; i++)
         for (unsigned int j = 0; j < tx.vin.size(); j++)
             BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
+    GetSignatureCacheStats(stats2);
+    BOOST_CHECK(stats2.nHits - stats1.nHits >= 5 * NPREV);
     mst2 = boost::posix_time::microsec_clock::local_time();
     msdiff = mst2 - mst1;
     long nManyValidate = msdiff.total_milliseconds();
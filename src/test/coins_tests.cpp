@@ -0,0 +1,204 @@
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// CCoinsView on a plain map, counting what reaches it
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+    unsigned int nWritten;
+
+    CCoinsViewTest() : nWritten(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid)
+    {
+        return mapCoins.count(txid) > 0;
+    }
+
+    bool BatchWrite(CCoinsMap &mapIn, CBlockIndex *pindex)
+    {
+        for (CCoinsMap::const_iterator it = mapIn.begin(); it != mapIn.end(); ++it) {
+            const CCoinsCacheEntry &entry = it->second;
+            if (!(entry.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            BOOST_CHECK(!((entry.flags & CCoinsCacheEntry::FRESH) && mapCoins.count(it->first)));
+            if ((entry.flags & CCoinsCacheEntry::FRESH) && entry.coins.IsPruned())
+                continue;
+            if (entry.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = entry.coins;
+            nWritten++;
+        }
+        return true;
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(pooledmap_like_map)
+{
+    pooledmap<uint256, int, CCoinsKeyHasher> map;
+    std::map<uint256, int> ref;
+    for (int i = 0; i < 20000; i++) {
+        uint256 key = insecure_rand() % 2000;
+        if (insecure_rand() % 3 == 0) {
+            BOOST_CHECK_EQUAL(map.erase(key), ref.erase(key) > 0);
+        } else {
+            std::pair<std::pair<const uint256, int>*, bool> ret = map.insert(key);
+            BOOST_CHECK_EQUAL(ret.second, ref.count(key) == 0);
+            ret.first->second = i;
+            ref[key] = i;
+        }
+        BOOST_CHECK_EQUAL(map.size(), ref.size());
+    }
+    unsigned int n = 0;
+    for (pooledmap<uint256, int, CCoinsKeyHasher>::const_iterator it = map.begin(); it != map.end(); ++it, n++)
+        BOOST_CHECK(ref.count(it->first) && ref[it->first] == it->second);
+    BOOST_CHECK_EQUAL(n, ref.size());
+    for (std::map<uint256, int>::const_iterator it = ref.begin(); it != ref.end(); ++it)
+        BOOST_CHECK(map.find(it->first) && map.find(it->first)->second == it->second);
+    map.clear();
+    BOOST_CHECK(map.empty() && map.begin() == map.end() && map.memory_usage() == 0);
+}
+
+// two caches on top of each other must behave like a map, and only hand changed coins down
+BOOST_AUTO_TEST_CASE(coins_cache_simulation)
+{
+    CCoinsViewTest base;
+    std::map<uint256, CCoins> ref;
+    CCoinsViewCache *pcache1 = new CCoinsViewCache(base);
+    CCoinsViewCache *pcache2 = new CCoinsViewCache(*pcache1, true);
+
+    for (int i = 0; i < 20000; i++) {
+        uint256 txid = insecure_rand() % 300;
+        CCoins &coins = ref[txid];
+        int nOp = insecure_rand() % 4;
+        if (nOp == 0 && coins.IsPruned()) {
+            // new transaction
+            coins.nVersion = 1;
+            coins.nHeight = i;
+            coins.vout.resize(1 + insecure_rand() % 3);
+            BOOST_FOREACH(CTxOut &out, coins.vout) {
+                out.nValue = 1 + insecure_rand() % 1000;
+                out.scriptPubKey.assign(insecure_rand() % 40, 0x51);
+            }
+            if (pcache2->HaveCoins(txid))
+                BOOST_CHECK(pcache2->AccessCoins(txid).IsPruned());
+            pcache2->SetNewCoins(txid, coins);
+        } else if (nOp == 1 && !coins.IsPruned()) {
+            // spend an output in place
+            BOOST_CHECK(pcache2->HaveCoins(txid));
+            int n = insecure_rand() % coins.vout.size();
+            CCoins &cached = pcache2->GetCoins(txid);
+            cached.Spend(n);
+            coins.Spend(n);
+        } else if (nOp == 2) {
+            CCoins check;
+            bool fHave = pcache2->GetCoins(txid, check);
+            BOOST_CHECK(fHave ? check == coins : coins.IsPruned());
+        } else if (insecure_rand() % 100 == 0) {
+            // flush the upper or both caches
+            BOOST_CHECK(pcache2->Flush());
+            BOOST_CHECK_EQUAL(pcache2->GetCacheSize(), 0U);
+            if (insecure_rand() % 2)
+                BOOST_CHECK(pcache1->Flush());
+        }
+        BOOST_CHECK(pcache1->DynamicMemoryUsage() >= pcache1->GetCacheSize() * sizeof(CCoinsCacheEntry));
+    }
+
+    BOOST_CHECK(pcache2->Flush());
+    BOOST_CHECK(pcache1->Flush());
+    for (std::map<uint256, CCoins>::iterator it = ref.begin(); it != ref.end(); it++) {
+        if (it->second.IsPruned())
+            BOOST_CHECK(!base.mapCoins.count(it->first));
+        else
+            BOOST_CHECK(base.mapCoins.count(it->first) && base.mapCoins[it->first] == it->second);
+    }
+
+    // reading does not write anything back
+    unsigned int nWritten = base.nWritten;
+    for (std::map<uint256, CCoins>::iterator it = ref.begin(); it != ref.end(); it++)
+        if (pcache2->HaveCoins(it->first))
+            pcache2->AccessCoins(it->first);
+    BOOST_CHECK(pcache2->Flush());
+    BOOST_CHECK(pcache1->Flush());
+    BOOST_CHECK_EQUAL(base.nWritten, nWritten);
+
+    // coins created and spent between flushes never reach the base
+    uint256 txid = 1000;
+    CCoins coins;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1;
+    BOOST_CHECK(!pcache2->HaveCoins(txid));
+    pcache2->SetNewCoins(txid, coins);
+    pcache2->GetCoins(txid).Spend(0);
+    BOOST_CHECK(pcache2->Flush());
+    BOOST_CHECK(pcache1->Flush());
+    BOOST_CHECK_EQUAL(base.nWritten, nWritten);
+
+    delete pcache2;
+    delete pcache1;
+}
+
+// the statistics must not depend on the order in which outputs come and go
+BOOST_AUTO_TEST_CASE(coins_stats_order)
+{
+    std::vector<CCoins> vCoins(50);
+    for (unsigned int i = 0; i < vCoins.size(); i++) {
+        vCoins[i].nHeight = i;
+        vCoins[i].fCoinBase = (i % 7 == 0);
+        vCoins[i].vout.resize(1 + insecure_rand() % 4);
+        BOOST_FOREACH(CTxOut &out, vCoins[i].vout) {
+            out.nValue = insecure_rand() % 100000;
+            out.scriptPubKey.assign(insecure_rand() % 40, 0x51);
+        }
+    }
+
+    // build everything, then take away the outputs at odd positions
+    CCoinsStats stats;
+    for (unsigned int i = 0; i < vCoins.size(); i++)
+        for (unsigned int n = 0; n < vCoins[i].vout.size(); n++)
+            stats.AddOutput(i, n, vCoins[i], vCoins[i].vout[n]);
+    CCoinsStats delta;
+    for (unsigned int i = 0; i < vCoins.size(); i++)
+        for (unsigned int n = 1; n < vCoins[i].vout.size(); n += 2)
+            delta.RemoveOutput(i, n, vCoins[i], vCoins[i].vout[n]);
+    stats += delta;
+
+    // only add the outputs at even positions, backwards
+    CCoinsStats statsRef;
+    for (unsigned int i = vCoins.size(); i-- > 0; )
+        for (unsigned int n = 0; n < vCoins[i].vout.size(); n += 2)
+            statsRef.AddOutput(i, n, vCoins[i], vCoins[i].vout[n]);
+
+    BOOST_CHECK(stats == statsRef);
+    BOOST_CHECK(stats.hashSet != 0);
+
+    // the same output at another height is a different element
+    CCoins other = vCoins[0];
+    other.nHeight++;
+    BOOST_CHECK(CCoinsStats::GetOutputHash(0, 0, other, other.vout[0]) != CCoinsStats::GetOutputHash(0, 0, vCoins[0], vCoins[0].vout[0]));
+
+    // the view cannot know them when its base does not
+    CCoinsViewTest base;
+    CCoinsViewCache cache(base);
+    BOOST_CHECK(!cache.GetStats(stats));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,179 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <string.h>
+
+#include "util.h"
+#include "Gost.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(gost_tests)
+
+// GOST R 34.11-2012 Appendix A, M1 written as a big endian number
+static const char* strM1 = "012345678901234567890123456789012345678901234567890123456789012";
+
+BOOST_AUTO_TEST_CASE(gostr3411_2012_testvectors)
+{
+    size_t len = strlen(strM1);
+    vector<unsigned char> m(strM1, strM1 + len);
+    reverse(m.begin(), m.end());
+
+    unsigned char digest[64];
+    i2p::crypto::GOSTR3411_2012_512(&m[0], len, digest);
+    BOOST_CHECK_EQUAL(HexStr(digest, digest + 64), "486f64c1917879417fef082b3381a4e211c324f074654c38823a7b76f830ad00fa1fbae42b1285c0352f227524bc9ab16254288dd6863dccd5b9f54a1ad0541b");
+    i2p::crypto::GOSTR3411_2012_256(&m[0], len, digest);
+    BOOST_CHECK_EQUAL(HexStr(digest, digest + 32), "00557be5e584fd52a449b16b0251d05d27f94ab76cbaa6da890b59d8ef1e159d");
+}
+
+// digests produced by the original bit-sliced SPL implementation
+BOOST_AUTO_TEST_CASE(gostr3411_2012_known_answers)
+{
+    unsigned char buf[200];
+    for (int i = 0; i < 200; i++)
+        buf[i] = i;
+
+    unsigned char digest[64];
+    i2p::crypto::GOSTR3411_2012_512(buf, 80, digest);
+    BOOST_CHECK_EQUAL(HexStr(digest, digest + 64), "de41efb1719af40e53e81544a5b4aaf1290a2b7b31a5c35cfc0049829fedc47dbd3b71d95abdd070a9cb97049c6b44719597c5e22b622a9e21e781a69cfcfbf8");
+    i2p::crypto::GOSTR3411_2012_256(buf, 80, digest);
+    BOOST_CHECK_EQUAL(HexStr(digest, digest + 32), "4173b193845a77e7dd7c4786d802c2df0c98d6c5be2a8f424b61a89a25de925d");
+    i2p::crypto::GOSTR3411_2012_512(buf, 200, digest);
+    BOOST_CHECK_EQUAL(HexStr(digest, digest + 64), "8104b25b4b2cc0d93f861fcb1b0c0f813f7c29687044db0feea3975c504f64450bd8069458382e31c4a5732462a03f9fc77dd0aba4355d9f6538ad240413d4e7");
+    i2p::crypto::GOSTR3411_2012_256(buf, 0, digest);
+    BOOST_CHECK_EQUAL(HexStr(digest, digest + 32), "bbe19c8d2025d99f943a932a0b365a822aa36a4c479d22cc02c8973e219a533f");
+}
+
+BOOST_AUTO_TEST_CASE(gostr3411_2012_ctx)
+{
+    // the context takes bytes in little endian order and must agree with the big endian entry points
+    unsigned char buf[200];
+    for (int i = 0; i < 200; i++)
+        buf[i] = i*7 + 3;
+
+    for (size_t len = 0; len <= 200; len += 25)
+    {
+        vector<unsigned char> rev(buf, buf + len);
+        reverse(rev.begin(), rev.end());
+        unsigned char expected[64];
+        i2p::crypto::GOSTR3411_2012_512(len ? &rev[0] : buf, len, expected);
+        reverse(expected, expected + 64);
+
+        unsigned char digest[64];
+        i2p::crypto::GOSTR3411_2012_CTX * ctx = i2p::crypto::GOSTR3411_2012_CTX_new();
+        i2p::crypto::GOSTR3411_2012_CTX_Init(ctx);
+        i2p::crypto::GOSTR3411_2012_CTX_Update(buf, len, ctx);
+        i2p::crypto::GOSTR3411_2012_CTX_Finish(digest, ctx);
+        i2p::crypto::GOSTR3411_2012_CTX_free(ctx);
+        BOOST_CHECK(memcmp(digest, expected, 64) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(gostr3411_2012_x4)
+{
+    unsigned char buf[4][300];
+    for (int n = 0; n < 4; n++)
+        for (int i = 0; i < 300; i++)
+            buf[n][i] = i*n + 11;
+
+    // lanes of different lengths finish at different steps
+    static const size_t vLen[][4] = { {0, 1, 63, 64}, {65, 80, 127, 128}, {80, 80, 80, 80}, {300, 0, 200, 129} };
+    for (unsigned int t = 0; t < sizeof(vLen)/sizeof(vLen[0]); t++)
+    {
+        const unsigned char* pbuf[4] = { buf[0], buf[1], buf[2], buf[3] };
+        unsigned char digest[4][64];
+        unsigned char* pdigest[4] = { digest[0], digest[1], digest[2], digest[3] };
+
+        i2p::crypto::GOSTR3411_2012_512_x4(pbuf, vLen[t], pdigest);
+        for (int n = 0; n < 4; n++)
+        {
+            unsigned char expected[64];
+            i2p::crypto::GOSTR3411_2012_512(buf[n], vLen[t][n], expected);
+            BOOST_CHECK(memcmp(digest[n], expected, 64) == 0);
+        }
+        i2p::crypto::GOSTR3411_2012_256_x4(pbuf, vLen[t], pdigest);
+        for (int n = 0; n < 4; n++)
+        {
+            unsigned char expected[32];
+            i2p::crypto::GOSTR3411_2012_256(buf[n], vLen[t][n], expected);
+            BOOST_CHECK(memcmp(digest[n], expected, 32) == 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(gostr3411_2012_header_ctx)
+{
+    unsigned char header[80];
+    for (int i = 0; i < 80; i++)
+        header[i] = i*13 + 5;
+
+    i2p::crypto::GOSTR3411_2012_HEADER_CTX * ctx = i2p::crypto::GOSTR3411_2012_HEADER_CTX_new();
+    i2p::crypto::GOSTR3411_2012_HEADER_CTX_Init(ctx, header);
+    static const uint32_t vNonce[] = { 0, 0x12345678, 0xfffffffe };
+    for (unsigned int t = 0; t < sizeof(vNonce)/sizeof(vNonce[0]); t++)
+    {
+        unsigned char digest[4][32];
+        unsigned char* pdigest[4] = { digest[0], digest[1], digest[2], digest[3] };
+        i2p::crypto::GOSTR3411_2012_HEADER_CTX_Hash_x4(ctx, vNonce[t], pdigest);
+        for (int n = 0; n < 4; n++)
+        {
+            uint32_t nNonce = vNonce[t] + n;
+            memcpy(header + 76, &nNonce, 4);
+            unsigned char hash1[64], expected[32];
+            i2p::crypto::GOSTR3411_2012_512(header, 80, hash1);
+            i2p::crypto::GOSTR3411_2012_256(hash1, 64, expected);
+            BOOST_CHECK(memcmp(digest[n], expected, 32) == 0);
+        }
+    }
+    i2p::crypto::GOSTR3411_2012_HEADER_CTX_free(ctx);
+}
+
+BOOST_AUTO_TEST_CASE(gostr3410_cryptopro_a)
+{
+    const auto& curve = i2p::crypto::GetGOSTR3410Curve(i2p::crypto::eGOSTR3410CryptoProA);
+    const EC_GROUP* group = curve->GetGroup();
+    BIGNUM* q = BN_new();
+    EC_GROUP_get_order(group, q, NULL);
+
+    // 1*P and (q-1)*P
+    BIGNUM* priv = BN_new();
+    BN_one(priv);
+    EC_POINT* pub = curve->MulP(priv);
+    BOOST_CHECK(EC_POINT_cmp(group, pub, EC_GROUP_get0_generator(group), NULL) == 0);
+    EC_POINT_free(pub);
+    BN_sub(priv, q, priv);
+    pub = curve->MulP(priv);
+    EC_POINT_invert(group, pub, NULL);
+    BOOST_CHECK(EC_POINT_cmp(group, pub, EC_GROUP_get0_generator(group), NULL) == 0);
+    EC_POINT_free(pub);
+
+    BIGNUM* digest = BN_new();
+    BIGNUM* r = BN_new();
+    BIGNUM* s = BN_new();
+    for (int i = 0; i < 16; i++)
+    {
+        BN_rand_range(priv, q);
+        BN_rand(digest, 256, -1, 0);
+        pub = curve->MulP(priv);
+        curve->Sign(priv, digest, r, s);
+        BOOST_CHECK(curve->Verify(pub, digest, r, s));
+
+        // the recovered key with the right parity of Cy is the signer's
+        EC_POINT* pub0 = curve->RecoverPublicKey(digest, r, s, false);
+        EC_POINT* pub1 = curve->RecoverPublicKey(digest, r, s, true);
+        BOOST_CHECK(pub0 && pub1);
+        BOOST_CHECK((EC_POINT_cmp(group, pub, pub0, NULL) == 0) != (EC_POINT_cmp(group, pub, pub1, NULL) == 0));
+        EC_POINT_free(pub0);
+        EC_POINT_free(pub1);
+
+        BN_add_word(s, 1);
+        BOOST_CHECK(!curve->Verify(pub, digest, r, s));
+        BN_sub_word(s, 1);
+        BN_add_word(digest, 1);
+        BOOST_CHECK(!curve->Verify(pub, digest, r, s));
+        EC_POINT_free(pub);
+    }
+    BN_free(q); BN_free(priv); BN_free(digest); BN_free(r); BN_free(s);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -138,4 +139,35 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_verify_batch)
+{
+    vector<CPubKey> vPubKey;
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig;
+    for (int n = 0; n < 20; n++)
+    {
+        CKey key;
+        key.MakeNewKey(n % 2 == 0);
+        uint256 hash = GetRandHash();
+        vector<unsigned char> sig;
+        BOOST_CHECK(key.Sign(hash, sig));
+        vPubKey.push_back(key.GetPubKey());
+        vHash.push_back(hash);
+        vSig.push_back(sig);
+    }
+
+    vector<bool> vfValid;
+    BOOST_CHECK(CPubKey::VerifyBatch(vPubKey, vHash, vSig, vfValid));
+    BOOST_CHECK(count(vfValid.begin(), vfValid.end(), true) == 20);
+
+    // every bad entry is reported, the others stay valid
+    vHash[3] = vHash[4];
+    vSig[7][10] ^= 1;
+    vSig[9].clear();
+    vPubKey[12] = vPubKey[13];
+    BOOST_CHECK(!CPubKey::VerifyBatch(vPubKey, vHash, vSig, vfValid));
+    for (int n = 0; n < 20; n++)
+        BOOST_CHECK(vfValid[n] == (n != 3 && n != 7 && n != 9 && n != 12));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,69 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+static void RandomScript(CScript &script) {
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int ops = (insecure_rand() % 10);
+    for (int i=0; i<ops; i++)
+        script << oplist[insecure_rand() % (sizeof(oplist)/sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction &tx, bool fSingle) {
+    tx.nVersion = insecure_rand();
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = (insecure_rand() % 2) ? insecure_rand() : 0;
+    int ins = (insecure_rand() % 4) + 1;
+    int outs = fSingle ? ins : (insecure_rand() % 4) + 1;
+    for (int in = 0; in < ins; in++) {
+        tx.vin.push_back(CTxIn());
+        CTxIn &txin = tx.vin.back();
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = insecure_rand() % 4;
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (insecure_rand() % 2) ? insecure_rand() : (unsigned int)-1;
+    }
+    for (int out = 0; out < outs; out++) {
+        tx.vout.push_back(CTxOut());
+        CTxOut &txout = tx.vout.back();
+        txout.nValue = insecure_rand() % 100000000;
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_cache)
+{
+    seed_insecure_rand(false);
+
+    // the cache must give the digests of the transaction copy, for every hash type
+    for (int i=0; i<500; i++) {
+        int nHashType = insecure_rand();
+        CTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        CSignatureHashCache cache(txTo);
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+            BOOST_CHECK(cache.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, txTo, nIn, nHashType));
+    }
+
+    // out of range input and SIGHASH_SINGLE output
+    CTransaction txTo;
+    RandomTransaction(txTo, false);
+    txTo.vout.resize(1);
+    CSignatureHashCache cache(txTo);
+    BOOST_CHECK(cache.SignatureHash(CScript(), txTo.vin.size(), SIGHASH_ALL) == 1);
+    if (txTo.vin.size() > 1)
+        BOOST_CHECK(cache.SignatureHash(CScript(), 1, SIGHASH_SINGLE) == 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
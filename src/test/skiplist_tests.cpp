@@ -0,0 +1,107 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "util.h"
+
+#define SKIPLIST_LENGTH 100000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = insecure_rand() % (SKIPLIST_LENGTH - 1);
+        int to = insecure_rand() % (from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+    BOOST_CHECK(vIndex[10].GetAncestor(11) == NULL);
+    BOOST_CHECK(vIndex[10].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_prune_header_chain)
+{
+    // blocks 0..999 in the block index, headers 1000..2999 ahead of it
+    const int nBlocks = 1000, nHeaders = 2000, nPruned = 700;
+    std::vector<uint256> vHash(nBlocks + nHeaders);
+    std::vector<CBlockIndex> vIndex(nBlocks + nPruned);
+    std::vector<CBlockIndex*> vHeader(nBlocks + nHeaders, (CBlockIndex*)NULL);
+    for (int i=0; i<nBlocks + nHeaders; i++)
+        vHash[i] = uint256(i + 1);
+
+    for (int i=0; i<nBlocks; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].BuildSkip();
+        mapBlockIndex[vHash[i]] = &vIndex[i];
+    }
+    for (int i=nBlocks; i<nBlocks + nHeaders; i++) {
+        CBlockIndex* pindex = new CBlockIndex();
+        pindex->nHeight = i;
+        pindex->pprev = (i == nBlocks) ? &vIndex[i - 1] : vHeader[i - 1];
+        pindex->phashBlock = &(mapHeaderIndex.insert(std::make_pair(vHash[i], pindex)).first->first);
+        pindex->BuildSkip();
+        vHeader[i] = pindex;
+        vHeaderChain.push_back(pindex);
+    }
+
+    // the blocks of the first headers arrive, then their headers are pruned
+    for (int i=nBlocks; i<nBlocks + nPruned; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = &vIndex[i - 1];
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].BuildSkip();
+        mapBlockIndex[vHash[i]] = &vIndex[i];
+    }
+    PruneHeaderChain();
+    BOOST_CHECK(vHeaderChain.size() == (size_t)(nHeaders - nPruned));
+    BOOST_CHECK(vHeaderChain.front() == vHeader[nBlocks + nPruned]);
+    BOOST_CHECK(vHeaderChain.front()->pprev == &vIndex[nBlocks + nPruned - 1]);
+
+    // no skip pointer may lead to a pruned header
+    for (int i=nBlocks + nPruned; i<nBlocks + nHeaders; i++) {
+        const CBlockIndex* pskip = vHeader[i]->pskip;
+        int nHeightSkip = pskip->nHeight;
+        BOOST_CHECK(pskip == (nHeightSkip < nBlocks + nPruned ? &vIndex[nHeightSkip] : vHeader[nHeightSkip]));
+    }
+    for (int i=0; i < 1000; i++) {
+        int from = nBlocks + nPruned + insecure_rand() % (nHeaders - nPruned);
+        int to = insecure_rand() % (from + 1);
+        BOOST_CHECK(vHeader[from]->GetAncestor(to) == (to < nBlocks + nPruned ? &vIndex[to] : vHeader[to]));
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vHeaderChain) {
+        uint256 hash = pindex->GetBlockHash();
+        delete pindex;
+        mapHeaderIndex.erase(hash);
+    }
+    vHeaderChain.clear();
+    for (int i=0; i<nBlocks + nPruned; i++)
+        mapBlockIndex.erase(vHash[i]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -334,4 +334,32 @@ BOOST_AUTO_TEST_CASE(util_TimingResistantEqual)
     BOOST_CHECK(!TimingResistantEqual(std::string("abc"), std::string("aba")));
 }
 
+BOOST_AUTO_TEST_CASE(util_CMappedFile)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_bitcoin_mapped_%" PRI64x, GetRand(1000000000));
+    FILE* file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    fwrite("abcdef", 1, 6, file);
+    fclose(file);
+
+    CMappedFile mapped;
+#ifdef WIN32
+    BOOST_CHECK(!mapped.Open(path));
+#else
+    BOOST_CHECK(mapped.Open(path));
+    BOOST_CHECK_EQUAL(std::string(mapped.data(), mapped.size()), "abcdef");
+
+    // appended data is only seen by a new mapping
+    file = fopen(path.string().c_str(), "ab");
+    fwrite("gh", 1, 2, file);
+    fclose(file);
+    BOOST_CHECK_EQUAL(mapped.size(), 6U);
+    BOOST_CHECK(mapped.Open(path));
+    BOOST_CHECK_EQUAL(std::string(mapped.data(), mapped.size()), "abcdefgh");
+#endif
+    mapped.Close();
+    BOOST_CHECK(mapped.data() == NULL && mapped.size() == 0);
+    boost::filesystem::remove(path);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,7 +1,10 @@
 #include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
 
 #include "main.h"
 #include "wallet.h"
+#include "walletdb.h"
+#include "init.h"
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -10,6 +13,10 @@
 // we repeat those tests this many times and only complain if all iterations of the test fail
 #define RANDOM_REPEATS 5
 
+// wallet size and number of payments for the coin selection benchmark
+#define BENCH_COINS 10000
+#define BENCH_PAYMENTS 20
+
 using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
@@ -46,6 +53,14 @@ static void empty_wallet(void)
     vCoins.clear();
 }
 
+struct CompareOutputValue
+{
+    bool operator()(const COutput& a, const COutput& b) const
+    {
+        return a.tx->vout[a.i].nValue > b.tx->vout[b.i].nValue;
+    }
+};
+
 static bool equal_sets(CoinSet a, CoinSet b)
 {
     pair<CoinSet::iterator, CoinSet::iterator> ret = mismatch(a.begin(), a.end(), b.begin());
@@ -254,7 +269,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
                 add_coin(COIN);
 
             // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
+            // but does depend on the random order given to coins of equal value
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
@@ -291,4 +306,174 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+// The stochastic approximation used before the branch and bound search,
+// kept here as the reference for the benchmark. Returns the total selected.
+static int64 ApproximateSelect(vector<int64> vValue, int64 nTargetValue)
+{
+    int64 nLowestLarger = std::numeric_limits<int64>::max();
+    vector<int64> vLower;
+    int64 nTotalLower = 0;
+    BOOST_FOREACH(int64 n, vValue)
+    {
+        if (n == nTargetValue)
+            return n;
+        else if (n < nTargetValue + CENT)
+        {
+            vLower.push_back(n);
+            nTotalLower += n;
+        }
+        else if (n < nLowestLarger)
+            nLowestLarger = n;
+    }
+    if (nTotalLower == nTargetValue)
+        return nTotalLower;
+    if (nTotalLower < nTargetValue)
+        return nLowestLarger == std::numeric_limits<int64>::max() ? 0 : nLowestLarger;
+
+    sort(vLower.rbegin(), vLower.rend());
+    int64 nBest = nTotalLower;
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        int64 nTarget = nTargetValue + nPass * CENT;
+        if (nPass == 1 && (nBest == nTargetValue || nTotalLower < nTarget))
+            break;
+        nBest = nTotalLower;
+        vector<char> vfIncluded;
+        for (int nRep = 0; nRep < 1000 && nBest != nTarget; nRep++)
+        {
+            vfIncluded.assign(vLower.size(), false);
+            int64 nTotal = 0;
+            bool fReachedTarget = false;
+            for (int nStep = 0; nStep < 2 && !fReachedTarget; nStep++)
+            {
+                for (unsigned int i = 0; i < vLower.size(); i++)
+                {
+                    if (nStep == 0 ? insecure_rand()&1 : !vfIncluded[i])
+                    {
+                        nTotal += vLower[i];
+                        vfIncluded[i] = true;
+                        if (nTotal >= nTarget)
+                        {
+                            fReachedTarget = true;
+                            if (nTotal < nBest)
+                                nBest = nTotal;
+                            nTotal -= vLower[i];
+                            vfIncluded[i] = false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (nLowestLarger != std::numeric_limits<int64>::max() &&
+        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || nLowestLarger <= nBest))
+        return nLowestLarger;
+    return nBest;
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_benchmark)
+{
+    CoinSet setCoinsRet;
+    int64 nValueRet;
+
+    empty_wallet();
+    seed_insecure_rand(true);
+    vector<int64> vValue;
+    for (int i = 0; i < BENCH_COINS; i++)
+    {
+        int64 nValue = COIN / 1000 + insecure_rand() % (50 * COIN);
+        add_coin(nValue);
+        vValue.push_back(nValue);
+    }
+    // in the order AvailableCoins returns them
+    vector<COutput> vSorted(vCoins);
+    sort(vSorted.begin(), vSorted.end(), CompareOutputValue());
+
+    int64 nTimeOld = 0, nTimeNew = 0, nChangeOld = 0, nChangeNew = 0;
+    for (int i = 0; i < BENCH_PAYMENTS; i++)
+    {
+        int64 nTarget = COIN + insecure_rand() % (100 * COIN);
+
+        int64 nStart = GetTimeMicros();
+        int64 nOld = ApproximateSelect(vValue, nTarget);
+        nTimeOld += GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, 1, 6, vSorted, setCoinsRet, nValueRet));
+        nTimeNew += GetTimeMicros() - nStart;
+
+        BOOST_CHECK(nValueRet >= nTarget);
+        int64 nTotal = 0;
+        BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& coin, setCoinsRet)
+            nTotal += coin.first->vout[coin.second].nValue;
+        BOOST_CHECK_EQUAL(nTotal, nValueRet);
+
+        nChangeOld += nOld - nTarget;
+        nChangeNew += nValueRet - nTarget;
+    }
+    empty_wallet();
+
+    BOOST_TEST_MESSAGE(strprintf("coin selection over %d coins: approximation %" PRI64d "us, change %s; "
+                                 "branch and bound %" PRI64d "us, change %s (per payment)",
+                                 BENCH_COINS, nTimeOld / BENCH_PAYMENTS, FormatMoney(nChangeOld / BENCH_PAYMENTS).c_str(),
+                                 nTimeNew / BENCH_PAYMENTS, FormatMoney(nChangeNew / BENCH_PAYMENTS).c_str()));
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup)
+{
+    // enough keys that TopUpKeyPool generates them on several threads
+    mapArgs["-keypool"] = "40";
+    BOOST_CHECK(pwalletMain->TopUpKeyPool());
+    BOOST_CHECK(pwalletMain->GetKeyPoolSize() >= 41);
+
+    // every key in the pool was written with its secret, and that secret matches
+    {
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_FOREACH(int64 nIndex, pwalletMain->setKeyPool)
+        {
+            CKeyPool keypool;
+            CPrivKey vchPrivKey;
+            CKey key;
+            BOOST_CHECK(walletdb.ReadPool(nIndex, keypool));
+            BOOST_CHECK(walletdb.ReadKey(keypool.vchPubKey, vchPrivKey));
+            BOOST_CHECK(key.SetPrivKey(vchPrivKey, keypool.vchPubKey.IsCompressed()));
+            BOOST_CHECK(key.GetPubKey() == keypool.vchPubKey);
+            BOOST_CHECK(pwalletMain->HaveKey(keypool.vchPubKey.GetID()));
+        }
+    }
+
+    int nSize = pwalletMain->GetKeyPoolSize();
+    CPubKey pubkey;
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey, false));
+    BOOST_CHECK(pubkey.IsValid());
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nSize - 1);
+    mapArgs.erase("-keypool");
+}
+
+BOOST_AUTO_TEST_CASE(keypool_refill_concurrent)
+{
+    // keypoolrefill and NewKeyPool fill the pool while a background top up is still
+    // generating keys for it, instead of counting those keys as there
+    mapArgs["-keypool"] = "200";
+    {
+        LOCK(pwalletMain->cs_wallet);
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        BOOST_FOREACH(int64 nIndex, pwalletMain->setKeyPool)
+            walletdb.ErasePool(nIndex);
+        pwalletMain->setKeyPool.clear();
+    }
+
+    boost::thread threadRefill(boost::bind(&CWallet::TopUpKeyPool, pwalletMain, false));
+    MilliSleep(10); // let it claim the missing keys first
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->TopUpKeyPool(true));
+        BOOST_CHECK(pwalletMain->GetKeyPoolSize() >= 201);
+    }
+    threadRefill.join();
+    BOOST_CHECK(pwalletMain->GetKeyPoolSize() >= 201);
+    mapArgs.erase("-keypool");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
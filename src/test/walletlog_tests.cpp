@@ -0,0 +1,178 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "walletlog.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(walletlog_tests)
+
+static CWalletLog::Data D(const string& str)
+{
+    return CWalletLog::Data(str.begin(), str.end());
+}
+
+static string S(const CWalletLog::Data& vch)
+{
+    return string(vch.begin(), vch.end());
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_reload)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_walletlog_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+    CWalletLog::Data value;
+
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(log.Write(D("a"), D("1"), true, NULL));
+        BOOST_CHECK(log.Write(D("b"), D("2"), true, NULL));
+        BOOST_CHECK(!log.Write(D("b"), D("3"), false, NULL));
+        BOOST_CHECK(log.Write(D("c"), D("3"), true, NULL));
+        BOOST_CHECK(log.Erase(D("a"), NULL));
+        BOOST_CHECK(log.Flush(false));
+
+        // an aborted transaction leaves nothing behind
+        CWalletLog::CBatch* pbatch = log.TxnBegin();
+        BOOST_CHECK(log.Write(D("b"), D("4"), true, pbatch));
+        BOOST_CHECK(log.Write(D("d"), D("5"), true, pbatch));
+        BOOST_CHECK(log.Read(D("b"), value) && S(value) == "4");
+        log.TxnAbort(pbatch);
+        BOOST_CHECK(log.Read(D("b"), value) && S(value) == "2");
+        BOOST_CHECK(!log.Exists(D("d")));
+
+        pbatch = log.TxnBegin();
+        BOOST_CHECK(log.Write(D("e"), D("6"), true, pbatch));
+        BOOST_CHECK(log.TxnCommit(pbatch));
+    }
+    BOOST_CHECK(CWalletLog::IsLogFile(path));
+
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(!log.Exists(D("a")));
+        BOOST_CHECK(log.Read(D("b"), value) && S(value) == "2");
+        BOOST_CHECK(!log.Exists(D("d")));
+        BOOST_CHECK(log.Read(D("e"), value) && S(value) == "6");
+
+        // keys are visited in byte order
+        CWalletLog::Data key;
+        BOOST_CHECK(log.Seek(D("b"), true, key, value) && S(key) == "b");
+        BOOST_CHECK(log.Seek(D("b"), false, key, value) && S(key) == "c");
+        BOOST_CHECK(log.Seek(D("\x7f"), true, key, value) == false);
+        BOOST_CHECK(log.Write(D("\x80"), D("7"), true, NULL));
+        BOOST_CHECK(log.Seek(D("\x7f"), true, key, value) && S(key) == "\x80");
+
+        BOOST_CHECK(log.Compact("c"));
+        BOOST_CHECK(!log.Exists(D("c")));
+    }
+
+    // a torn write at the end loses the last frame only
+    uintmax_t nSize = boost::filesystem::file_size(path);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(log.Write(D("f"), D("8"), true, NULL));
+        BOOST_CHECK(log.Flush(false));
+    }
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 1);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(!log.Exists(D("f")));
+        BOOST_CHECK(log.Read(D("e"), value) && S(value) == "6");
+        BOOST_CHECK(!log.Exists(D("c")));
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_damaged_frame)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_walletlog_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+    CWalletLog::Data value;
+
+    // three frames, one record each
+    uintmax_t nFirstEnd, nSecondEnd;
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(log.Write(D("a"), D("1"), true, NULL));
+        BOOST_CHECK(log.Flush(false));
+        nFirstEnd = boost::filesystem::file_size(path);
+        BOOST_CHECK(log.Write(D("b"), D("2"), true, NULL));
+        BOOST_CHECK(log.Flush(false));
+        nSecondEnd = boost::filesystem::file_size(path);
+        BOOST_CHECK(log.Write(D("c"), D("3"), true, NULL));
+        BOOST_CHECK(log.Flush(false));
+    }
+    uintmax_t nSize = boost::filesystem::file_size(path);
+
+    // flip a bit in the value of the middle frame
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, nSecondEnd - 1, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, nSecondEnd - 1, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+
+    // the load fails and the frames after the damage stay on disk
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(!log.Open());
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+
+    // damage in the last frame is cut off as a torn write
+    boost::filesystem::resize_file(path, nSecondEnd);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(log.Read(D("a"), value) && S(value) == "1");
+        BOOST_CHECK(!log.Exists(D("b")));
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nFirstEnd);
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_damaged_frame_size)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_walletlog_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+
+    uintmax_t nHeaderEnd;
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        nHeaderEnd = boost::filesystem::file_size(path);
+        BOOST_CHECK(log.Write(D("a"), D("1"), true, NULL));
+        BOOST_CHECK(log.Flush(false));
+        BOOST_CHECK(log.Write(D("b"), D("2"), true, NULL));
+        BOOST_CHECK(log.Flush(false));
+        BOOST_CHECK(log.Write(D("c"), D("3"), true, NULL));
+        BOOST_CHECK(log.Flush(false));
+    }
+    uintmax_t nSize = boost::filesystem::file_size(path);
+
+    // a size past the end of the file would pass for a torn append
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, nHeaderEnd + 3, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, nHeaderEnd + 3, SEEK_SET);
+    fputc(c ^ 0x80, file);
+    fclose(file);
+
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(!log.Open());
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
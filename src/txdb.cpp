@@ -20,7 +20,21 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+void static BatchWriteStats(CLevelDBBatch &batch, const CCoinsStats &stats) {
+    batch.Write('S', stats);
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", CLevelDBProfile("coinsdb", nCacheSize), fMemory, fWipe), fStats(false) {
+    uint256 hashBestChain;
+    if (!db.Read('B', hashBestChain)) {
+        // a new database starts from an empty set
+        fStats = true;
+    } else if (db.Read('S', stats) && stats.hashBlock == hashBestChain) {
+        fStats = true;
+    } else {
+        // written by an older version, or the best block was moved without them
+        stats = CCoinsStats();
+    }
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
@@ -41,7 +55,7 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -53,24 +67,89 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    unsigned int nChanged = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        const CCoinsCacheEntry &entry = it->second;
+        if (!(entry.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // never written to the database, so there is nothing to erase
+        if ((entry.flags & CCoinsCacheEntry::FRESH) && entry.coins.IsPruned())
+            continue;
+        BatchWriteCoins(batch, it->first, entry.coins);
+        nChanged++;
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+    CCoinsStats statsNew = stats;
+    if (fStats) {
+        statsNew += statsPending;
+        if (pindex)
+            statsNew.hashBlock = pindex->GetBlockHash();
+        BatchWriteStats(batch, statsNew);
+    }
 
-    return db.WriteBatch(batch);
+    printf("Committing %u changed transactions (out of %u) to coin database...\n", nChanged, (unsigned int)mapCoins.size());
+    if (!db.WriteBatch(batch))
+        return false;
+    stats = statsNew;
+    statsPending = CCoinsStats();
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &statsOut) {
+    if (!fStats)
+        return false;
+    statsOut = stats;
+    CBlockIndex *pindex = GetBestBlock();
+    statsOut.nHeight = pindex ? pindex->nHeight : 0;
+    return true;
+}
+
+bool CCoinsViewDB::UpdateStats(const CCoinsStats &delta) {
+    statsPending += delta;
+    return true;
+}
+
+bool CCoinsViewDB::WriteStats(const CCoinsStats &statsIn) {
+    CLevelDBBatch batch;
+    BatchWriteStats(batch, statsIn);
+    if (!db.WriteBatch(batch))
+        return false;
+    stats = statsIn;
+    fStats = true;
+    return true;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", CLevelDBProfile("blockdb", nCacheSize), fMemory, fWipe) {
+    fSnapshotToken = Exists('S');
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+    if (!fSnapshotToken)
+        return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+
+    // the snapshot no longer matches once the index changes
+    CLevelDBBatch batch;
+    batch.Erase('S');
+    batch.Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+    if (!WriteBatch(batch))
+        return false;
+    fSnapshotToken = false;
+    return true;
+}
+
+bool CBlockTreeDB::ReadSnapshotToken(uint256 &token) {
+    return fSnapshotToken && Read('S', token);
+}
+
+bool CBlockTreeDB::WriteSnapshotToken(const uint256 &token) {
+    if (!Write('S', token, true))
+        return false;
+    fSnapshotToken = true;
+    return true;
 }
 
 bool CBlockTreeDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
@@ -111,54 +190,61 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
-    pcursor->SeekToFirst();
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
+/** Add up the coins whose txid starts with a byte in [nBegin, nEnd) (in serialized order) */
+void static ScanCoinsRange(CLevelDB *pdb, unsigned int nBegin, unsigned int nEnd, CCoinsStats *pstats, int *pfOk) {
+    leveldb::Iterator *pcursor = pdb->NewIterator();
+    const char pchStart[2] = {'c', (char)nBegin};
+    pcursor->Seek(leveldb::Slice(pchStart, sizeof(pchStart)));
+    *pfOk = true;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() < 2 || slKey[0] != 'c' || (unsigned char)slKey[1] >= nEnd)
+            break;
         try {
-            leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            uint256 txhash;
+            ssKey >> chType >> txhash;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+            pstats->nTransactions++;
+            pstats->nSerializedSize += 32 + slValue.size();
+            for (unsigned int i=0; i<coins.vout.size(); i++) {
+                if (!coins.vout[i].IsNull())
+                    pstats->AddOutput(txhash, i, coins, coins.vout[i]);
             }
-            pcursor->Next();
         } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            *pfOk = false;
+            break;
         }
     }
     delete pcursor;
-    stats.nHeight = GetBestBlock()->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+}
+
+bool CCoinsViewDB::ScanStats(CCoinsStats &statsOut, int nThreads) {
+    nThreads = std::max(1, std::min(nThreads, 256));
+    std::vector<CCoinsStats> vStats(nThreads);
+    std::vector<int> vOk(nThreads, 0);
+
+    // the sums do not depend on order, so each thread takes its own slice of the key space
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ScanCoinsRange, &db, 256 * i / nThreads, 256 * (i + 1) / nThreads, &vStats[i], &vOk[i]));
+    threadGroup.join_all();
+
+    statsOut = CCoinsStats();
+    for (int i = 0; i < nThreads; i++) {
+        if (!vOk[i])
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        statsOut += vStats[i];
+    }
+    CBlockIndex *pindex = GetBestBlock();
+    if (pindex) {
+        statsOut.nHeight = pindex->nHeight;
+        statsOut.hashBlock = pindex->GetBlockHash();
+    }
     return true;
 }
 
@@ -13,6 +13,9 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDB db;
+    bool fStats;              // statistics stored with the coins are known
+    CCoinsStats stats;        // statistics of the coins in the database
+    CCoinsStats statsPending; // change to be written with the next BatchWrite
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -21,10 +24,21 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    bool UpdateStats(const CCoinsStats &delta);
+
+    // Compute the statistics by reading every coin, split over nThreads threads by txid.
+    // The database must not be written meanwhile (hold cs_main).
+    bool ScanStats(CCoinsStats &stats, int nThreads);
+    // Store statistics computed by ScanStats, to be maintained from now on
+    bool WriteStats(const CCoinsStats &stats);
+
+    CLevelDB &GetDB() { return db; }
 };
 
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDB
 {
@@ -33,8 +47,14 @@ public:
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    // the token of the block index snapshot is stored, so it is still current
+    bool fSnapshotToken;
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadSnapshotToken(uint256 &token);
+    bool WriteSnapshotToken(const uint256 &token);
+    bool HaveSnapshotToken() const { return fSnapshotToken; }
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
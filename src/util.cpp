@@ -10,6 +10,7 @@
 #endif
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #endif
 
@@ -71,6 +72,8 @@ namespace boost {
 #include "shlobj.h"
 #elif defined(__linux__)
 # include <sys/prctl.h>
+# include <pthread.h>
+# include <sched.h>
 #endif
 
 using namespace std;
@@ -1295,6 +1298,41 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
 #endif
 }
 
+bool CMappedFile::Open(const boost::filesystem::path& path)
+{
+    Close();
+#ifdef WIN32
+    // a mapped file cannot be truncated on Windows, which FlushBlockFile does
+    return false;
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    pch = (const char*)p;
+    nSize = st.st_size;
+    return true;
+#endif
+}
+
+void CMappedFile::Close()
+{
+#ifndef WIN32
+    if (pch)
+        munmap((void*)pch, nSize);
+#endif
+    pch = NULL;
+    nSize = 0;
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
@@ -1533,6 +1571,23 @@ void RenameThread(const char* name)
 #endif
 }
 
+void SetThreadAffinity(int nCore)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    // Pin to one core, wrapping around when there are more threads than cores
+    int nCores = boost::thread::hardware_concurrency();
+    if (nCores <= 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(nCore % nCores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    // Prevent warnings for unused parameters...
+    (void)nCore;
+#endif
+}
+
 bool NewThread(void(*pfn)(void*), void* parg)
 {
     try
@@ -517,6 +517,30 @@ public:
     }
 };
 
+/** Read-only memory mapping of a whole file, as large as the file was when it was
+ *  opened. Data appended later is not covered, open a new mapping for it.
+ *  Not available on Windows, where Open always fails.
+ */
+class CMappedFile
+{
+private:
+    const char* pch;
+    size_t nSize;
+
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    CMappedFile() : pch(NULL), nSize(0) {}
+    ~CMappedFile() { Close(); }
+
+    bool Open(const boost::filesystem::path& path);
+    void Close();
+
+    const char* data() const { return pch; }
+    size_t size() const { return nSize; }
+};
+
 bool NewThread(void(*pfn)(void*), void* parg);
 
 #ifdef WIN32
@@ -549,6 +573,7 @@ inline void ExitThread(size_t nExitCode)
 #endif
 
 void RenameThread(const char* name);
+void SetThreadAffinity(int nCore);
 
 inline uint32_t ByteReverse(uint32_t value)
 {
@@ -623,4 +648,20 @@ template <typename Callable> void TraceThread(const char* name,  Callable func)
     }
 }
 
+// Interrupts and joins a thread group when it goes out of scope, on any way out,
+// so threads that work on an object of that scope are gone before the object is.
+class CThreadGroupStopper
+{
+private:
+    boost::thread_group &threadGroup;
+
+public:
+    explicit CThreadGroupStopper(boost::thread_group &threadGroupIn) : threadGroup(threadGroupIn) {}
+    ~CThreadGroupStopper()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+};
+
 #endif
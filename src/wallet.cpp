@@ -9,6 +9,8 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "coincontrol.h"
+#include "checkpoints.h"
+#include "Gost.h" // i2pd
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -105,7 +107,10 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 return false;
             if (CCryptoKeyStore::Unlock(vMasterKey))
+            {
+                RequestKeyPoolRefill();
                 return true;
+            }
         }
     }
     return false;
@@ -354,6 +359,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                 {
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
+                    UpdateUnspent(txin.prevout.hash, wtx);
                     wtx.WriteToDisk();
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
@@ -368,7 +374,54 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // called when keys are imported, outputs may have become ours
+        fUnspentStale = true;
+        fBalanceCached = false;
+    }
+}
+
+// Bring the outputs of one wallet transaction in mapUnspent up to date,
+// after it was added or its spent flags changed. Requires cs_wallet.
+void CWallet::UpdateUnspent(const uint256 &hash, const CWalletTx &wtx)
+{
+    fBalanceCached = false;
+    if (fUnspentStale)
+        return;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        COutPoint outpoint(hash, i);
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+        {
+            mapUnspent[outpoint] = &wtx;
+            setUnspentByValue.insert(make_pair(wtx.vout[i].nValue, outpoint));
+        }
+        else if (mapUnspent.erase(outpoint))
+            setUnspentByValue.erase(make_pair(wtx.vout[i].nValue, outpoint));
+    }
+}
+
+// Requires cs_wallet
+const map<COutPoint, const CWalletTx*> &CWallet::GetUnspent() const
+{
+    if (fUnspentStale)
+    {
+        mapUnspent.clear();
+        setUnspentByValue.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            const CWalletTx &wtx = (*it).second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+                {
+                    COutPoint outpoint((*it).first, i);
+                    mapUnspent.insert(make_pair(outpoint, &wtx));
+                    setUnspentByValue.insert(make_pair(wtx.vout[i].nValue, outpoint));
+                }
+        }
+        fUnspentStale = false;
+        fBalanceCached = false;
     }
+    return mapUnspent;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -455,6 +508,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        if (fInsertedNew || fUpdated)
+            UpdateUnspent(hash, wtx);
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -530,8 +585,16 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            for (unsigned int i = 0; i < (*mi).second.vout.size(); i++)
+                if (mapUnspent.erase(COutPoint(hash, i)))
+                    setUnspentByValue.erase(make_pair((*mi).second.vout[i].nValue, COutPoint(hash, i)));
+            fBalanceCached = false;
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -767,26 +830,210 @@ bool CWalletTx::WriteToDisk()
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
-{
-    int ret = 0;
-
-    CBlockIndex* pindex = pindexStart;
+/** Rescan pipeline for ScanForWalletTransactions. A reader thread reads the blocks ahead,
+ *  a pool of threads hashes their transactions and looks for outputs that may pay the
+ *  wallet, and the calling thread hands the transactions that may matter to
+ *  AddToWalletIfInvolvingMe, in chain order. Outputs are matched without the wallet lock,
+ *  against a bloom filter and a set of the key and script ids the wallet had at the start;
+ *  keys added meanwhile are new and cannot own old outputs. Spends of wallet transactions
+ *  are found in the serial stage, since those may have been found by the scan itself. */
+class CWalletScanner
+{
+private:
+    struct CEntry
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        CBlockIndex *pindex;
+        CBlock block;
+        std::vector<char> vMatch; // per transaction: an output may be ours
+        bool fMatched;
+    };
+
+    CBloomFilter filter;
+    std::set<uint160> setIds;
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;
+    boost::condition_variable condMatch;
+    boost::condition_variable condUpdate;
+    std::deque<CEntry*> queueWindow; // all blocks in flight, in chain order
+    std::deque<CEntry*> queueMatch;  // blocks no matcher has taken yet
+    CBlockIndex *pindexNext;         // next block for the reader, NULL once all are taken
+    bool fReadDone;                  // the reader has put the last block in the window
+
+    static const unsigned int MAX_WINDOW = 32;
+
+    bool HaveId(const uint160 &id) const {
+        return filter.contains(std::vector<unsigned char>(id.begin(), id.end())) && setIds.count(id);
+    }
+
+    // same cases as IsMine(), but only asks whether one of the ids involved is ours
+    bool MayBeMine(const CScript &scriptPubKey) const {
+        std::vector<std::vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        if (!Solver(scriptPubKey, whichType, vSolutions))
+            return false;
+        switch (whichType)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        case TX_PUBKEY:
+            return HaveId(CPubKey(vSolutions[0]).GetID());
+        case TX_PUBKEYHASH:
+        case TX_SCRIPTHASH:
+            return HaveId(uint160(vSolutions[0]));
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (HaveId(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    void ThreadRead() {
+        RenameThread("gostcoin-rescanrd");
+        while (true) {
+            boost::this_thread::interruption_point();
+            // owned here until queueWindow takes it, so an interrupted wait
+            // or a failed read does not leak it
+            std::unique_ptr<CEntry> pentry;
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueWindow.size() >= MAX_WINDOW)
+                    condRead.wait(lock);
+                if (pindexNext == NULL) {
+                    fReadDone = true;
+                    condUpdate.notify_all();
+                    return;
+                }
+                pentry.reset(new CEntry());
+                pentry->pindex = pindexNext;
+                pindexNext = pindexNext->pnext;
+            }
+            pentry->block.ReadFromDisk(pentry->pindex);
+            pentry->fMatched = false;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queueWindow.push_back(pentry.get());
+            CEntry *pentryQueued = pentry.release();
+            queueMatch.push_back(pentryQueued);
+            condMatch.notify_one();
+        }
+    }
+
+    void ThreadMatch() {
+        RenameThread("gostcoin-rescanmt");
+        while (true) {
+            CEntry *pentry;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueMatch.empty())
+                    condMatch.wait(lock);
+                pentry = queueMatch.front();
+                queueMatch.pop_front();
+            }
+            const CBlock &block = pentry->block;
+            block.BuildMerkleTree();
+            pentry->vMatch.assign(block.vtx.size(), false);
+            for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                BOOST_FOREACH(const CTxOut &txout, block.vtx[i].vout) {
+                    if (MayBeMine(txout.scriptPubKey)) {
+                        pentry->vMatch[i] = true;
+                        break;
+                    }
+                }
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pentry->fMatched = true;
+            if (pentry == queueWindow.front())
+                condUpdate.notify_one();
+        }
+    }
+
+    // the next block in chain order once it is matched; NULL at the end
+    CEntry *Pop() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(queueWindow.empty() ? fReadDone : queueWindow.front()->fMatched))
+            condUpdate.wait(lock);
+        if (queueWindow.empty())
+            return NULL;
+        CEntry *pentry = queueWindow.front();
+        queueWindow.pop_front();
+        condRead.notify_one();
+        return pentry;
+    }
+
+public:
+    CWalletScanner(const CWallet &wallet, CBlockIndex *pindexStart) : pindexNext(pindexStart), fReadDone(false) {
+        wallet.GetKeyAndScriptIds(setIds);
+        filter = CBloomFilter(std::max((size_t)1, setIds.size()), 0.001, GetRand(std::numeric_limits<unsigned int>::max()), BLOOM_UPDATE_NONE);
+        BOOST_FOREACH(const uint160 &id, setIds)
+            filter.insert(std::vector<unsigned char>(id.begin(), id.end()));
+    }
+
+    ~CWalletScanner() {
+        BOOST_FOREACH(CEntry *pentry, queueWindow)
+            delete pentry;
+    }
+
+    int Run(CWallet &wallet, bool fUpdate) {
+        int ret = 0;
+        int nHeightStart = pindexNext ? pindexNext->nHeight : 0;
+        int64 nProgressTime = GetTime();
+        boost::thread_group threadGroup;
+        CThreadGroupStopper stopper(threadGroup); // before the scanner goes, whatever ends the scan
+        threadGroup.create_thread(boost::bind(&CWalletScanner::ThreadRead, this));
+        int nMatchThreads = std::max(1, (int)boost::thread::hardware_concurrency() - 1);
+        for (int i = 0; i < nMatchThreads; i++)
+            threadGroup.create_thread(boost::bind(&CWalletScanner::ThreadMatch, this));
+
+        while (true) {
+            std::unique_ptr<CEntry> pentry(Pop());
+            if (pentry.get() == NULL)
+                break;
+            const CBlock &block = pentry->block;
+
+            LOCK(wallet.cs_wallet);
+            for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                const CTransaction &tx = block.vtx[i];
+                const uint256 &hash = block.GetTxHash(i);
+                bool fRelevant = pentry->vMatch[i] || wallet.mapWallet.count(hash);
+                if (!fRelevant && !tx.IsCoinBase()) {
+                    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                        if (wallet.mapWallet.count(txin.prevout.hash)) {
+                            fRelevant = true;
+                            break;
+                        }
+                    }
+                }
+                if (fRelevant && wallet.AddToWalletIfInvolvingMe(hash, tx, &block, fUpdate))
                     ret++;
             }
-            pindex = pindex->pnext;
+
+            if (GetTime() >= nProgressTime + 10) {
+                nProgressTime = GetTime();
+                printf("Rescanning: block %d of %d (from %d), %d transactions found, progress=%.3f\n",
+                       pentry->pindex->nHeight, nBestHeight, nHeightStart, ret, Checkpoints::GuessVerificationProgress(pentry->pindex));
+            }
         }
+        return ret;
     }
-    return ret;
+};
+
+void CWallet::GetKeyAndScriptIds(std::set<uint160> &setIds) const
+{
+    LOCK(cs_KeyStore);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    setIds.insert(setKeys.begin(), setKeys.end());
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+        setIds.insert((*it).first);
+}
+
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    if (pindexStart == NULL)
+        return 0;
+    CWalletScanner scanner(*this, pindexStart);
+    return scanner.Run(*this, fUpdate);
 }
 
 void CWallet::ReacceptWalletTransactions()
@@ -822,6 +1069,7 @@ void CWallet::ReacceptWalletTransactions()
                 }
                 if (fUpdated)
                 {
+                    UpdateUnspent(item.first, wtx);
                     printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
@@ -912,169 +1160,235 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+// Sum the balances of all confirmation classes in one pass over the transactions
+// with unspent outputs of ours. Requires cs_wallet.
+void CWallet::CacheBalances() const
 {
-    int64 nTotal = 0;
+    if (fBalanceCached && pindexBalanceCached == pindexBest)
+        return;
+
+    const map<COutPoint, const CWalletTx*> &mapCoins = GetUnspent();
+    int64 nBalance = 0, nUnconfirmed = 0, nImmature = 0;
+    bool fAllFinal = true;
+    map<COutPoint, const CWalletTx*>::const_iterator it = mapCoins.begin();
+    while (it != mapCoins.end())
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        const CWalletTx* pcoin = (*it).second;
+        bool fFinal = pcoin->IsFinal();
+        bool fConfirmed = pcoin->IsConfirmed();
+        int64 nCredit = pcoin->GetAvailableCredit();
+        if (fConfirmed)
+            nBalance += nCredit;
+        if (!fFinal || !fConfirmed)
+            nUnconfirmed += nCredit;
+        nImmature += pcoin->GetImmatureCredit();
+        fAllFinal &= fFinal;
+
+        // on to the next transaction
+        it = mapCoins.upper_bound(COutPoint((*it).first.hash, std::numeric_limits<unsigned int>::max()));
     }
 
-    return nTotal;
+    nBalanceCached = nBalance;
+    nUnconfirmedBalanceCached = nUnconfirmed;
+    nImmatureBalanceCached = nImmature;
+    // a time locked transaction becomes final without any block or wallet change
+    fBalanceCached = fAllFinal;
+    pindexBalanceCached = pindexBest;
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceCached;
 }
 
 int64 CWallet::GetUnconfirmedBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nUnconfirmedBalanceCached;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
-// populate vCoins with vector of spendable COutputs
+// populate vCoins with vector of spendable COutputs, in order of decreasing value
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const
 {
     vCoins.clear();
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
+        const map<COutPoint, const CWalletTx*> &mapCoins = GetUnspent();
+        vCoins.reserve(mapCoins.size());
 
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
-                continue;
+        // depth of each transaction seen so far, or -1 if its outputs are not usable
+        map<const CWalletTx*, int> mapDepth;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        // the outputs in setUnspentByValue are ours and not spent
+        for (set<pair<int64, COutPoint> >::const_reverse_iterator it = setUnspentByValue.rbegin(); it != setUnspentByValue.rend(); ++it)
+        {
+            const COutPoint &outpoint = (*it).second;
+            if ((*it).first < nMinimumInputValue)
+                break;
+            if (IsLockedCoin(outpoint.hash, outpoint.n) ||
+                (coinControl && coinControl->HasSelected() && !coinControl->IsSelected(outpoint.hash, outpoint.n)))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i))) 
-                        vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+            const CWalletTx* pcoin = mapCoins.find(outpoint)->second;
+            map<const CWalletTx*, int>::iterator mi = mapDepth.find(pcoin);
+            if (mi == mapDepth.end())
+            {
+                bool fUsable = pcoin->IsFinal() &&
+                               !(fOnlyConfirmed && !pcoin->IsConfirmed()) &&
+                               !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0);
+                mi = mapDepth.insert(make_pair(pcoin, fUsable ? pcoin->GetDepthInMainChain() : -1)).first;
             }
+            if ((*mi).second >= 0)
+                vCoins.push_back(COutput(pcoin, outpoint.n, (*mi).second));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
-                                  vector<char>& vfBest, int64& nBest, int iterations = 1000)
+typedef pair<int64, pair<const CWalletTx*,unsigned int> > CValueCoin;
+
+// Find the subset of vValue (in order of decreasing value) with the smallest total of at least
+// nTargetValue. This is a depth-first branch and bound: each coin is tried included before
+// excluded, and a branch is cut as soon as the coins left cannot reach the target or its total
+// cannot beat the best one found. The search stops at an exact match or after nMaxTries steps.
+// If no subset better than all of vValue is found, nBest is nTotalLower and vfBest is all set.
+static void SelectBestSubset(const vector<CValueCoin>& vValue, int64 nTotalLower, int64 nTargetValue,
+                             vector<char>& vfBest, int64& nBest, int nMaxTries = 100000)
 {
-    vector<char> vfIncluded;
+    // vRemaining[i] is the total of the coins from i on
+    vector<int64> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
 
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
+    vector<char> vfIncluded(vValue.size(), false);
+    vector<unsigned int> vIncluded, vBest;
+    bool fFound = false;
+    int64 nTotal = 0;
+    unsigned int i = 0;
 
-    seed_insecure_rand();
+    nBest = nTotalLower;
 
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    for (int nTries = 0; nTries < nMaxTries && nBest != nTargetValue; nTries++)
     {
-        vfIncluded.assign(vValue.size(), false);
-        int64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[i] < nTargetValue || nTotal >= nBest)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
         {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
+            // adding more coins can only make it worse
+            nBest = nTotal;
+            vBest = vIncluded;
+            fFound = true;
+            fBacktrack = true;
+        }
+        else if (i > 0 && !vfIncluded[i - 1] && vValue[i].first == vValue[i - 1].first)
+        {
+            // taking this coin in place of an equal one that was left out gives nothing new
+            i++;
+        }
+        else
+        {
+            vfIncluded[i] = true;
+            vIncluded.push_back(i);
+            nTotal += vValue[i].first;
+            i++;
+        }
+
+        if (fBacktrack)
+        {
+            if (vIncluded.empty())
+                break;
+            // leave out the last included coin and go on with the next one
+            i = vIncluded.back();
+            vIncluded.pop_back();
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            i++;
         }
     }
+
+    vfBest.assign(vValue.size(), !fFound);
+    BOOST_FOREACH(unsigned int n, vBest)
+        vfBest[n] = true;
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+struct CInsecureRand
+{
+    int operator()(int nMax) const { return insecure_rand() % nMax; }
+};
+
+// vCoins is expected in order of decreasing value, as returned by AvailableCoins; otherwise it is sorted here
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
-    // List of values less than target
-    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<int64>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
-    int64 nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Coins with enough confirmations, by decreasing value
+    vector<CValueCoin> vValue;
+    vValue.reserve(vCoins.size());
+    bool fSorted = true;
 
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
         if (output.nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
             continue;
 
-        int i = output.i;
-        int64 n = pcoin->vout[i].nValue;
+        int64 n = pcoin->vout[output.i].nValue;
+        if (!vValue.empty() && n > vValue.back().first)
+            fSorted = false;
+        vValue.push_back(make_pair(n, make_pair(pcoin, output.i)));
+    }
 
-        pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+    if (!fSorted)
+        sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
 
-        if (n == nTargetValue)
+    // Which of several coins of the same value gets spent should not be predictable
+    seed_insecure_rand();
+    for (vector<CValueCoin>::iterator it = vValue.begin(); it != vValue.end(); )
+    {
+        vector<CValueCoin>::iterator itEnd = it + 1;
+        while (itEnd != vValue.end() && (*itEnd).first == (*it).first)
+            ++itEnd;
+        if (itEnd - it > 1)
+        {
+            CInsecureRand rand;
+            random_shuffle(it, itEnd, rand);
+        }
+        it = itEnd;
+    }
+
+    // The smallest coin of at least the target plus a cent, and the coins less than that
+    CValueCoin coinLowestLarger;
+    coinLowestLarger.first = std::numeric_limits<int64>::max();
+    coinLowestLarger.second.first = NULL;
+    vector<CValueCoin>::iterator itLower = vValue.begin();
+    while (itLower != vValue.end() && (*itLower).first >= nTargetValue + CENT)
+        coinLowestLarger = *itLower++;
+    vValue.erase(vValue.begin(), itLower);
+
+    int64 nTotalLower = 0;
+    BOOST_FOREACH(const CValueCoin& coin, vValue)
+    {
+        if (coin.first == nTargetValue)
         {
             setCoinsRet.insert(coin.second);
             nValueRet += coin.first;
             return true;
         }
-        else if (n < nTargetValue + CENT)
-        {
-            vValue.push_back(coin);
-            nTotalLower += n;
-        }
-        else if (n < coinLowestLarger.first)
-        {
-            coinLowestLarger = coin;
-        }
+        nTotalLower += coin.first;
     }
 
     if (nTotalLower == nTargetValue)
@@ -1096,16 +1410,15 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Solve subset sum by branch and bound
     vector<char> vfBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    SelectBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        SelectBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest);
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    // If we have a bigger coin and (either the search didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
     if (coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
@@ -1353,6 +1666,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 CWalletTx &coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
+                UpdateUnspent(txin.prevout.hash, coin);
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
@@ -1535,44 +1849,145 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
-        printf("CWallet::NewKeyPool wrote %" PRI64d " new keys\n", nKeys);
+        TopUpKeyPool(true);
+        printf("CWallet::NewKeyPool wrote %" PRIszu " new keys\n", setKeyPool.size());
     }
     return true;
 }
 
-bool CWallet::TopUpKeyPool()
+// Generate every nStep'th key from nStart on, with its public key and, if pvPrivKeys is
+// given, the DER private key that goes to disk. Both derive the public point by GOST
+// R 34.10 scalar multiplication, which is what makes new keys expensive.
+static void GenerateKeys(vector<CKey>* pvKeys, vector<CPubKey>* pvPubKeys, vector<CPrivKey>* pvPrivKeys, bool fCompressed, unsigned int nStart, unsigned int nStep)
 {
+    for (unsigned int i = nStart; i < pvKeys->size(); i += nStep)
+    {
+        CKey& key = (*pvKeys)[i];
+        key.MakeNewKey(fCompressed);
+        (*pvPubKeys)[i] = key.GetPubKey();
+        if (pvPrivKeys)
+            (*pvPrivKeys)[i] = key.GetPrivKey();
+    }
+}
+
+bool CWallet::TopUpKeyPool(bool fFill)
+{
+    unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+    unsigned int nKeys;
+    bool fCompressed, fCrypted;
     {
         LOCK(cs_wallet);
 
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
+        // keys generated elsewhere may not make it into the pool (the wallet can be
+        // locked before they are done), so a caller that needs a full pool ignores them
+        unsigned int nHave = setKeyPool.size() + (fFill ? 0 : nKeyPoolGenerating);
+        nKeys = nHave < nTargetSize + 1 ? nTargetSize + 1 - nHave : 0;
+        // someone else is generating, but the caller needs a key now
+        if (nKeys == 0 && setKeyPool.empty())
+            nKeys = 1;
+        if (nKeys == 0)
+            return true;
+        nKeyPoolGenerating += nKeys;
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+        fCrypted = IsCrypted();
+    }
+
+    // Generate the keys in parallel and without the wallet lock (unless the caller holds
+    // it), so reserving keys from the pool does not wait for the EC math
+    vector<CKey> vKeys(nKeys);
+    vector<CPubKey> vPubKeys(nKeys);
+    vector<CPrivKey> vPrivKeys(fCrypted ? 0 : nKeys);
+    RandAddSeedPerfmon();
+    // the curve is set up on first use, which is not safe to race
+    i2p::crypto::GetGOSTR3410Curve(i2p::crypto::eGOSTR3410CryptoProA);
+    unsigned int nThreads = min((unsigned int)max(1, (int)boost::thread::hardware_concurrency()), (nKeys + 15) / 16);
+    if (nThreads <= 1)
+        GenerateKeys(&vKeys, &vPubKeys, fCrypted ? NULL : &vPrivKeys, fCompressed, 0, 1);
+    else
+    {
+        // the workers fill our vectors, so do not leave before they are done
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threadGroup;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&GenerateKeys, &vKeys, &vPubKeys, fCrypted ? NULL : &vPrivKeys, fCompressed, i, nThreads));
+        threadGroup.join_all();
+    }
+
+    {
+        LOCK(cs_wallet);
+        nKeyPoolGenerating -= nKeys;
+
+        // the wallet may have been locked meanwhile; encrypted since is fine, AddKeyPubKey encrypts
+        if (IsLocked())
+            return false;
+
+        // Compressed public keys were introduced in version 0.6.0
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY);
 
-        // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+        // Write all keys and pool entries in one transaction
+        CWalletDB walletdb(strWalletFile);
+        if (!walletdb.TxnBegin())
+            throw runtime_error("TopUpKeyPool() : couldn't begin db transaction");
+        // AddCryptedKey writes to pwalletdbEncryption when set
+        pwalletdbEncryption = &walletdb;
+        int64 nEnd = 1;
+        if (!setKeyPool.empty())
+            nEnd = *(--setKeyPool.end()) + 1;
+        bool fOk = true;
+        for (unsigned int i = 0; i < nKeys && fOk; i++)
         {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %" PRI64d ", size=%" PRIszu "\n", nEnd, setKeyPool.size());
+            fOk = CCryptoKeyStore::AddKeyPubKey(vKeys[i], vPubKeys[i]) &&
+                  (IsCrypted() || !fFileBacked || walletdb.WriteKey(vPubKeys[i], vPrivKeys[i])) &&
+                  walletdb.WritePool(nEnd + i, CKeyPool(vPubKeys[i]));
         }
+        pwalletdbEncryption = NULL;
+        if (!fOk)
+        {
+            walletdb.TxnAbort();
+            throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+        }
+        if (!walletdb.TxnCommit())
+            throw runtime_error("TopUpKeyPool() : couldn't commit db transaction");
+
+        for (unsigned int i = 0; i < nKeys; i++)
+            setKeyPool.insert(nEnd + i);
+        printf("keypool added keys %" PRI64d "-%" PRI64d ", size=%" PRIszu "\n", nEnd, nEnd + nKeys - 1, setKeyPool.size());
     }
     return true;
 }
 
+void CWallet::RequestKeyPoolRefill()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+    fKeyPoolRefill = true;
+    condKeyPoolRefill.notify_one();
+}
+
+void CWallet::ThreadKeyPoolRefill()
+{
+    // Make this thread recognisable as the key-topping-up thread
+    RenameThread("bitcoin-key-top");
+
+    while (true)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+            while (!fKeyPoolRefill)
+                condKeyPoolRefill.wait(lock);
+            fKeyPoolRefill = false;
+        }
+        try {
+            TopUpKeyPool();
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadKeyPoolRefill()");
+        }
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -1580,7 +1995,8 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
+        // Normally ThreadKeyPoolRefill keeps the pool filled; only generate keys here if it fell behind
+        if (setKeyPool.empty() && !IsLocked())
             TopUpKeyPool();
 
         // Get the oldest key
@@ -1597,6 +2013,10 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
         assert(keypool.vchPubKey.IsValid());
         printf("keypool reserve %" PRI64d "\n", nIndex);
+
+        int64 nTargetSize = max(GetArg("-keypool", 100), 0LL);
+        if ((int64)setKeyPool.size() < GetArg("-keypoolmin", nTargetSize / 2) && !IsLocked())
+            RequestKeyPoolRefill();
     }
 }
 
@@ -73,6 +73,33 @@ private:
 
     CWalletDB *pwalletdbEncryption;
 
+    // Background keypool refill: ThreadKeyPoolRefill waits on condKeyPoolRefill until
+    // RequestKeyPoolRefill sets fKeyPoolRefill
+    boost::mutex mutexKeyPoolRefill;
+    boost::condition_variable condKeyPoolRefill;
+    bool fKeyPoolRefill;
+    // Keys TopUpKeyPool is generating outside cs_wallet, so concurrent top ups do not overshoot
+    unsigned int nKeyPoolGenerating;
+
+    // Unspent outputs of mapWallet that are ours, so balances and coin selection need not
+    // visit every wallet transaction. Rebuilt from mapWallet when fUnspentStale is set
+    // (on load, or when IsMine may have changed for old outputs).
+    mutable std::map<COutPoint, const CWalletTx*> mapUnspent;
+    // The same outputs ordered by value, so coin selection starts from a sorted list
+    mutable std::set<std::pair<int64, COutPoint> > setUnspentByValue;
+    mutable bool fUnspentStale;
+
+    // Balances over mapUnspent, valid while the wallet and the best block do not change
+    mutable bool fBalanceCached;
+    mutable const CBlockIndex *pindexBalanceCached;
+    mutable int64 nBalanceCached;
+    mutable int64 nUnconfirmedBalanceCached;
+    mutable int64 nImmatureBalanceCached;
+
+    void UpdateUnspent(const uint256 &hash, const CWalletTx &wtx);
+    const std::map<COutPoint, const CWalletTx*> &GetUnspent() const;
+    void CacheBalances() const;
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -99,7 +126,11 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fKeyPoolRefill = false;
+        nKeyPoolGenerating = 0;
         nOrderPosNext = 0;
+        fUnspentStale = true;
+        fBalanceCached = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -109,7 +140,11 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fKeyPoolRefill = false;
+        nKeyPoolGenerating = 0;
         nOrderPosNext = 0;
+        fUnspentStale = true;
+        fBalanceCached = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -126,7 +161,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -173,6 +208,8 @@ public:
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
+    // the ids of all keys and scripts an output can pay the wallet with
+    void GetKeyAndScriptIds(std::set<uint160> &setIds) const;
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -188,7 +225,10 @@ public:
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
     bool NewKeyPool();
-    bool TopUpKeyPool();
+    // fFill: fill the pool now, not counting the keys a concurrent top up still generates
+    bool TopUpKeyPool(bool fFill = false);
+    void RequestKeyPoolRefill();
+    void ThreadKeyPoolRefill();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -68,7 +68,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -388,7 +388,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             printf("Error getting wallet database cursor\n");
@@ -493,7 +493,16 @@ void ThreadFlushWalletDB(const string& strFile)
         if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
-            if (lockDb)
+            if (lockDb && bitdb.mapLog.count(strFile))
+            {
+                // A record log is synced while in use, and compacted if it grew enough
+                printf("Flushing %s\n", strFile.c_str());
+                nLastFlushed = nWalletDBUpdated;
+                int64 nStart = GetTimeMillis();
+                bitdb.mapLog[strFile]->Flush();
+                printf("Flushed %s %" PRI64d "ms\n", strFile.c_str(), GetTimeMillis() - nStart);
+            }
+            else if (lockDb)
             {
                 // Don't do this if any databases are in use
                 int nRefCount = 0;
@@ -535,6 +544,18 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
     {
         {
             LOCK(bitdb.cs_db);
+            CWalletLog *plog = bitdb.OpenLog(wallet.strWalletFile);
+            if (plog)
+            {
+                // A record log can be copied while in use
+                filesystem::path pathDest(strDest);
+                if (filesystem::is_directory(pathDest))
+                    pathDest /= wallet.strWalletFile;
+                if (!plog->Backup(pathDest))
+                    return false;
+                printf("copied %s to %s\n", wallet.strWalletFile.c_str(), pathDest.string().c_str());
+                return true;
+            }
             if (!bitdb.mapFileUseCount.count(wallet.strWalletFile) || bitdb.mapFileUseCount[wallet.strWalletFile] == 0)
             {
                 // Flush log data to the dat file
@@ -657,3 +678,94 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename)
 {
     return CWalletDB::Recover(dbenv, filename, false);
 }
+
+//
+// Convert a Berkeley DB wallet.dat to a record log (CWalletLog), keeping the
+// original as wallet.timestamp.bak.
+//
+bool CWalletDB::Migrate(CDBEnv& dbenv, std::string filename)
+{
+    filesystem::path pathWallet = GetDataDir() / filename;
+    if (!filesystem::exists(pathWallet) || CWalletLog::IsLogFile(pathWallet))
+        return true;
+
+    int64 nStart = GetTimeMillis();
+    std::string newFilename = strprintf("wallet.%" PRI64d ".bak", GetTime());
+    filesystem::path pathLog = GetDataDir() / (filename + ".migrate");
+    filesystem::remove(pathLog);
+
+    bool fSuccess = true;
+    unsigned int nRecords = 0;
+    {
+        CWalletLog log(pathLog);
+        if (!log.Open())
+        {
+            filesystem::remove(pathLog);
+            return error("CWalletDB::Migrate() : cannot create %s", pathLog.string().c_str());
+        }
+
+        CWalletDB db(filename, "r");
+        CDBCursor* pcursor = db.GetCursor();
+        if (!pcursor)
+        {
+            printf("Error: cannot read %s\n", filename.c_str());
+            fSuccess = false;
+        }
+        while (fSuccess)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                printf("Error reading next record from %s\n", filename.c_str());
+                fSuccess = false;
+                break;
+            }
+            CWalletLog::Data vchKey, vchValue;
+            ssKey.GetAndClear(vchKey);
+            ssValue.GetAndClear(vchValue);
+            fSuccess = log.Write(vchKey, vchValue, false, NULL);
+            nRecords++;
+        }
+        if (pcursor)
+            pcursor->close();
+        // all records go to the log as one frame
+        fSuccess = fSuccess && log.Flush(false);
+    }
+
+    {
+        LOCK(dbenv.cs_db);
+        dbenv.CloseDb(filename);
+        dbenv.CheckpointLSN(filename);
+        dbenv.mapFileUseCount.erase(filename);
+        // filename is about to become a record log
+        dbenv.setBerkeleyFile.erase(filename);
+    }
+    if (!fSuccess)
+    {
+        filesystem::remove(pathLog);
+        return error("CWalletDB::Migrate() : migration of %s failed", filename.c_str());
+    }
+
+    // Between the two renames there is no wallet file; should the process die
+    // there, the user has to finish the second rename by hand
+    printf("Migrate: renaming %s to %s; if %s is missing afterwards, rename %s to %s\n",
+           filename.c_str(), newFilename.c_str(), filename.c_str(), pathLog.string().c_str(), filename.c_str());
+    int result = dbenv.dbenv.dbrename(NULL, filename.c_str(), NULL,
+                                      newFilename.c_str(), DB_AUTO_COMMIT);
+    if (result != 0)
+    {
+        filesystem::remove(pathLog);
+        return error("CWalletDB::Migrate() : failed to rename %s to %s", filename.c_str(), newFilename.c_str());
+    }
+    if (!RenameOver(pathLog, pathWallet))
+        return error("CWalletDB::Migrate() : failed to rename %s to %s, rename it by hand to recover the wallet (%s holds the original)",
+                     pathLog.string().c_str(), filename.c_str(), newFilename.c_str());
+
+    printf("Migrated %u records of %s to a record log in %" PRI64d "ms, Berkeley DB file kept as %s\n",
+           nRecords, filename.c_str(), GetTimeMillis() - nStart, newFilename.c_str());
+    return true;
+}
@@ -50,6 +50,11 @@ public:
         return Erase(std::make_pair(std::string("tx"), hash));
     }
 
+    bool ReadKey(const CPubKey& vchPubKey, CPrivKey& vchPrivKey)
+    {
+        return Read(std::make_pair(std::string("key"), vchPubKey), vchPrivKey);
+    }
+
     bool WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey)
     {
         nWalletDBUpdated++;
@@ -158,6 +163,7 @@ public:
     DBErrors LoadWallet(CWallet* pwallet);
     static bool Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys);
     static bool Recover(CDBEnv& dbenv, std::string filename);
+    static bool Migrate(CDBEnv& dbenv, std::string filename);
 };
 
 #endif // BITCOIN_WALLETDB_H
@@ -0,0 +1,506 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+#include "util.h"
+
+#include <openssl/sha.h>
+#include <boost/version.hpp>
+#include <boost/filesystem.hpp>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+using namespace boost;
+
+// File layout: the magic and format version, then frames of
+// [payload size][checksum of the size][checksum of the payload][payload], where the
+// payload is a sequence of records 'w' key value (write) or 'e' key (erase). Version 1
+// frames had no checksum of the size; such logs are read, then rewritten as version 2.
+static const char pchLogMagic[8] = { 'g', 'o', 's', 't', 'w', 'l', 'o', 'g' };
+static const unsigned int LOG_VERSION = 2;
+static const unsigned int LOG_HEADER_SIZE = sizeof(pchLogMagic) + 4;
+static const unsigned int FRAME_HEADER_SIZE = 12;
+static const unsigned int FRAME_HEADER_SIZE_V1 = 8;
+
+// Frames written by Compact are cut at this payload size
+static const unsigned int MAX_COMPACT_FRAME = 1 << 20;
+// Compact once the file is this large and twice the size of the live records
+static const int64 MIN_COMPACT_SIZE = 1 << 20;
+
+static unsigned int FrameChecksum(const char* pbegin, const char* pend)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)pbegin, pend - pbegin, hash);
+    return hash[0] | (hash[1] << 8) | (hash[2] << 16) | ((unsigned int)hash[3] << 24);
+}
+
+static bool WriteHeader(FILE* file)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(pchLogMagic) << LOG_VERSION;
+    return fwrite(&ss.begin()[0], 1, ss.size(), file) == ss.size();
+}
+
+static bool WriteFrame(FILE* file, const CDataStream& ssOps)
+{
+    const char* pbegin = &ssOps.begin()[0];
+    unsigned int nSize = ssOps.size();
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << nSize;
+    unsigned int nSizeChecksum = FrameChecksum(&ssHeader.begin()[0], &ssHeader.begin()[0] + 4);
+    ssHeader << nSizeChecksum << FrameChecksum(pbegin, pbegin + nSize);
+    return fwrite(&ssHeader.begin()[0], 1, ssHeader.size(), file) == ssHeader.size() &&
+           fwrite(pbegin, 1, nSize, file) == nSize;
+}
+
+static unsigned int RecordSize(const CWalletLog::Data& key, const CWalletLog::Data& value)
+{
+    return 1 + GetSerializeSize(key, SER_DISK, CLIENT_VERSION) + GetSerializeSize(value, SER_DISK, CLIENT_VERSION);
+}
+
+bool CWalletLog::CompareData::operator()(const Data& a, const Data& b) const
+{
+    size_t nSize = std::min(a.size(), b.size());
+    int c = nSize ? memcmp(&a[0], &b[0], nSize) : 0;
+    return c < 0 || (c == 0 && a.size() < b.size());
+}
+
+CWalletLog::CWalletLog(const filesystem::path& pathIn) :
+    path(pathIn), fileAppend(NULL), ssPending(SER_DISK, CLIENT_VERSION), nBatchesOpen(0), nFileSize(0), nLiveSize(0)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    if (fileAppend)
+    {
+        WritePendingLocked();
+        FileCommit(fileAppend);
+        fclose(fileAppend);
+    }
+}
+
+bool CWalletLog::IsLogFile(const filesystem::path& pathFile)
+{
+    FILE* file = fopen(pathFile.string().c_str(), "rb");
+    if (!file)
+        return false;
+    char pchMagic[sizeof(pchLogMagic)];
+    bool fLog = fread(pchMagic, 1, sizeof(pchMagic), file) == sizeof(pchMagic) &&
+                memcmp(pchMagic, pchLogMagic, sizeof(pchMagic)) == 0;
+    fclose(file);
+    return fLog;
+}
+
+// Set (pvalue != NULL) or erase a record in memory. Requires cs
+void CWalletLog::Apply(const Data& key, const Data* pvalue)
+{
+    DataMap::iterator mi = mapData.find(key);
+    if (mi != mapData.end())
+    {
+        nLiveSize -= RecordSize((*mi).first, (*mi).second);
+        if (!pvalue)
+        {
+            mapData.erase(mi);
+            return;
+        }
+        (*mi).second = *pvalue;
+    }
+    else if (pvalue)
+        mi = mapData.insert(make_pair(key, *pvalue)).first;
+    else
+        return;
+    nLiveSize += RecordSize((*mi).first, (*mi).second);
+}
+
+bool CWalletLog::Open()
+{
+    LOCK(cs);
+    if (fileAppend)
+        return true;
+
+    if (filesystem::exists(path))
+    {
+        if (!Load())
+            return false;
+    }
+    else
+    {
+        FILE* file = fopen(path.string().c_str(), "wb");
+        if (!file)
+            return error("CWalletLog::Open() : cannot create %s", path.string().c_str());
+        bool fOk = WriteHeader(file);
+        FileCommit(file);
+        fclose(file);
+        if (!fOk)
+            return error("CWalletLog::Open() : cannot write %s", path.string().c_str());
+        nFileSize = LOG_HEADER_SIZE;
+    }
+
+    // Load may have opened it already, when it rewrote an old log
+    if (!fileAppend)
+        fileAppend = fopen(path.string().c_str(), "ab");
+    if (!fileAppend)
+        return error("CWalletLog::Open() : cannot open %s for appending", path.string().c_str());
+    return true;
+}
+
+// Replay the log into mapData, and cut off an incomplete last frame. Damage anywhere
+// else fails the load and leaves the file as it is. Requires cs
+bool CWalletLog::Load()
+{
+    int64 nStart = GetTimeMillis();
+
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return error("CWalletLog::Load() : cannot open %s", path.string().c_str());
+    int nSize = GetFilesize(file);
+    if (nSize < (int)LOG_HEADER_SIZE)
+    {
+        fclose(file);
+        return error("CWalletLog::Load() : %s is too short", path.string().c_str());
+    }
+
+#ifndef WIN32
+    void* pmap = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (pmap == MAP_FAILED)
+    {
+        fclose(file);
+        return error("CWalletLog::Load() : cannot map %s", path.string().c_str());
+    }
+    madvise(pmap, nSize, MADV_SEQUENTIAL);
+    const char* pbegin = (const char*)pmap;
+#else
+    vector<char> vchFile(nSize);
+    if (fread(&vchFile[0], 1, nSize, file) != (size_t)nSize)
+    {
+        fclose(file);
+        return error("CWalletLog::Load() : cannot read %s", path.string().c_str());
+    }
+    const char* pbegin = &vchFile[0];
+#endif
+    const char* pend = pbegin + nSize;
+
+    bool fOk = true;
+    unsigned int nVersion = 0;
+    memcpy(&nVersion, pbegin + sizeof(pchLogMagic), 4);
+    if (memcmp(pbegin, pchLogMagic, sizeof(pchLogMagic)) != 0)
+        fOk = error("CWalletLog::Load() : %s is not a record log", path.string().c_str());
+    else if (nVersion > LOG_VERSION)
+        fOk = error("CWalletLog::Load() : %s has unknown version %u", path.string().c_str(), nVersion);
+
+    const char* p = pbegin + LOG_HEADER_SIZE;
+    unsigned int nFrames = 0;
+    unsigned int nFrameHeaderSize = nVersion >= 2 ? FRAME_HEADER_SIZE : FRAME_HEADER_SIZE_V1;
+    while (fOk && pend - p >= (int)nFrameHeaderSize)
+    {
+        unsigned int nFrameSize, nChecksum;
+        memcpy(&nFrameSize, p, 4);
+        memcpy(&nChecksum, p + nFrameHeaderSize - 4, 4);
+        if (nVersion >= 2)
+        {
+            // a whole frame header is never torn, the size in it has to be right
+            unsigned int nSizeChecksum;
+            memcpy(&nSizeChecksum, p + 4, 4);
+            if (FrameChecksum(p, p + 4) != nSizeChecksum)
+            {
+                fOk = error("CWalletLog::Load() : damaged frame header at offset %" PRI64d " of %s",
+                            (int64)(p - pbegin), path.string().c_str());
+                break;
+            }
+        }
+        const char* pframe = p + nFrameHeaderSize;
+        if (nFrameSize > (size_t)(pend - pframe) || FrameChecksum(pframe, pframe + nFrameSize) != nChecksum)
+        {
+            // only a frame of known size that reaches the end of the file is taken for a
+            // torn append and cut away, anything else is damage
+            if (nVersion < 2 || nFrameSize < (size_t)(pend - pframe))
+                fOk = error("CWalletLog::Load() : damaged frame at offset %" PRI64d " of %s",
+                            (int64)(p - pbegin), path.string().c_str());
+            break;
+        }
+
+        try {
+            CDataStream ss(pframe, pframe + nFrameSize, SER_DISK, CLIENT_VERSION);
+            while (!ss.empty())
+            {
+                char cOp;
+                Data key, value;
+                ss >> cOp >> key;
+                if (cOp == 'w')
+                {
+                    ss >> value;
+                    Apply(key, &value);
+                }
+                else if (cOp == 'e')
+                    Apply(key, NULL);
+                else
+                    throw runtime_error("unknown record type");
+            }
+        }
+        catch (std::exception &e) {
+            // the checksum matched, so this was written that way
+            fOk = error("CWalletLog::Load() : bad record in %s: %s", path.string().c_str(), e.what());
+        }
+        p = pframe + nFrameSize;
+        nFrames++;
+    }
+    int64 nValid = p - pbegin;
+
+#ifndef WIN32
+    munmap(pmap, nSize);
+#endif
+    fclose(file);
+    if (!fOk)
+        return false;
+
+    if (nValid < nSize)
+    {
+        printf("CWalletLog::Load() : dropping an incomplete frame of %" PRI64d " bytes at the end of %s\n",
+               nSize - nValid, path.string().c_str());
+        file = fopen(path.string().c_str(), "r+b");
+        if (!file || !TruncateFile(file, nValid))
+        {
+            if (file)
+                fclose(file);
+            return error("CWalletLog::Load() : cannot truncate %s", path.string().c_str());
+        }
+        FileCommit(file);
+        fclose(file);
+    }
+    nFileSize = nValid;
+
+    printf("Loaded %s: %u frames, %" PRIszu " records, %" PRI64d " bytes in %" PRI64d "ms\n",
+           path.string().c_str(), nFrames, mapData.size(), nFileSize, GetTimeMillis() - nStart);
+
+    if (nVersion < LOG_VERSION)
+    {
+        printf("CWalletLog::Load() : rewriting %s in format version %u\n", path.string().c_str(), LOG_VERSION);
+        return CompactLocked(NULL);
+    }
+    return true;
+}
+
+bool CWalletLog::Read(const Data& key, Data& value) const
+{
+    LOCK(cs);
+    DataMap::const_iterator mi = mapData.find(key);
+    if (mi == mapData.end())
+        return false;
+    value = (*mi).second;
+    return true;
+}
+
+bool CWalletLog::Exists(const Data& key) const
+{
+    LOCK(cs);
+    return mapData.count(key) > 0;
+}
+
+bool CWalletLog::Write(const Data& key, const Data& value, bool fOverwrite, CBatch* pbatch)
+{
+    LOCK(cs);
+    DataMap::iterator mi = mapData.find(key);
+    bool fExists = (mi != mapData.end());
+    if (fExists && !fOverwrite)
+        return false;
+
+    if (pbatch)
+    {
+        pbatch->vUndo.push_back(make_pair(key, make_pair(fExists, fExists ? (*mi).second : Data())));
+        pbatch->ssOps << 'w' << key << value;
+    }
+    else
+        ssPending << 'w' << key << value;
+    Apply(key, &value);
+    return true;
+}
+
+bool CWalletLog::Erase(const Data& key, CBatch* pbatch)
+{
+    LOCK(cs);
+    DataMap::iterator mi = mapData.find(key);
+    if (mi == mapData.end())
+        return true;
+
+    if (pbatch)
+    {
+        pbatch->vUndo.push_back(make_pair(key, make_pair(true, (*mi).second)));
+        pbatch->ssOps << 'e' << key;
+    }
+    else
+        ssPending << 'e' << key;
+    Apply(key, NULL);
+    return true;
+}
+
+bool CWalletLog::Seek(const Data& key, bool fInclusive, Data& keyRet, Data& valueRet) const
+{
+    LOCK(cs);
+    DataMap::const_iterator mi = fInclusive ? mapData.lower_bound(key) : mapData.upper_bound(key);
+    if (mi == mapData.end())
+        return false;
+    keyRet = (*mi).first;
+    valueRet = (*mi).second;
+    return true;
+}
+
+CWalletLog::CBatch* CWalletLog::TxnBegin()
+{
+    LOCK(cs);
+    nBatchesOpen++;
+    return new CBatch();
+}
+
+bool CWalletLog::TxnCommit(CBatch* pbatch)
+{
+    LOCK(cs);
+    nBatchesOpen--;
+    // the transaction goes into the same frame as the pending changes before it
+    ssPending += pbatch->ssOps;
+    delete pbatch;
+    return WritePendingLocked();
+}
+
+void CWalletLog::TxnAbort(CBatch* pbatch)
+{
+    LOCK(cs);
+    nBatchesOpen--;
+    for (unsigned int i = pbatch->vUndo.size(); i > 0; i--)
+    {
+        const pair<Data, pair<bool, Data> >& undo = pbatch->vUndo[i - 1];
+        Apply(undo.first, undo.second.first ? &undo.second.second : NULL);
+    }
+    delete pbatch;
+}
+
+// Requires cs
+bool CWalletLog::WritePendingLocked()
+{
+    if (ssPending.empty())
+        return true;
+    if (!fileAppend)
+        return error("CWalletLog::WritePending() : %s is not open", path.string().c_str());
+    if (!WriteFrame(fileAppend, ssPending) || fflush(fileAppend) != 0)
+        return error("CWalletLog::WritePending() : write to %s failed", path.string().c_str());
+    nFileSize += FRAME_HEADER_SIZE + ssPending.size();
+    ssPending.clear();
+    return true;
+}
+
+bool CWalletLog::WritePending()
+{
+    LOCK(cs);
+    return WritePendingLocked();
+}
+
+bool CWalletLog::Flush(bool fCompact)
+{
+    LOCK(cs);
+    if (!WritePendingLocked())
+        return false;
+    if (fileAppend)
+        FileCommit(fileAppend);
+    if (fCompact && nBatchesOpen == 0 && nFileSize >= MIN_COMPACT_SIZE && nFileSize > 2 * (nLiveSize + LOG_HEADER_SIZE))
+        return CompactLocked(NULL);
+    return true;
+}
+
+bool CWalletLog::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    if (nBatchesOpen > 0)
+        return error("CWalletLog::Compact() : %s has open transactions", path.string().c_str());
+    return CompactLocked(pszSkip);
+}
+
+// Requires cs and no open transactions
+bool CWalletLog::CompactLocked(const char* pszSkip)
+{
+    int64 nStart = GetTimeMillis();
+    if (!WritePendingLocked())
+        return false;
+
+    if (pszSkip)
+    {
+        size_t nSkip = strlen(pszSkip);
+        DataMap::iterator mi = mapData.begin();
+        while (mi != mapData.end())
+        {
+            const Data& key = (*mi).first;
+            if (key.empty() || strncmp(&key[0], pszSkip, std::min(key.size(), nSkip)) == 0)
+            {
+                nLiveSize -= RecordSize((*mi).first, (*mi).second);
+                mapData.erase(mi++);
+            }
+            else
+                mi++;
+        }
+    }
+
+    filesystem::path pathTmp = path.string() + ".compact";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("CWalletLog::Compact() : cannot create %s", pathTmp.string().c_str());
+
+    bool fOk = WriteHeader(file);
+    int64 nNewSize = LOG_HEADER_SIZE;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    for (DataMap::const_iterator mi = mapData.begin(); fOk && mi != mapData.end(); ++mi)
+    {
+        ss << 'w' << (*mi).first << (*mi).second;
+        if (ss.size() >= MAX_COMPACT_FRAME)
+        {
+            fOk = WriteFrame(file, ss);
+            nNewSize += FRAME_HEADER_SIZE + ss.size();
+            ss.clear();
+        }
+    }
+    if (fOk && !ss.empty())
+    {
+        fOk = WriteFrame(file, ss);
+        nNewSize += FRAME_HEADER_SIZE + ss.size();
+    }
+    FileCommit(file);
+    fclose(file);
+    if (!fOk)
+    {
+        filesystem::remove(pathTmp);
+        return error("CWalletLog::Compact() : write to %s failed", pathTmp.string().c_str());
+    }
+
+    if (fileAppend)
+        fclose(fileAppend);
+    fOk = RenameOver(pathTmp, path);
+    fileAppend = fopen(path.string().c_str(), "ab");
+    if (!fOk || !fileAppend)
+        return error("CWalletLog::Compact() : cannot replace %s", path.string().c_str());
+
+    printf("Compacted %s: %" PRIszu " records, %" PRI64d " to %" PRI64d " bytes in %" PRI64d "ms\n",
+           path.string().c_str(), mapData.size(), nFileSize, nNewSize, GetTimeMillis() - nStart);
+    nFileSize = nNewSize;
+    return true;
+}
+
+bool CWalletLog::Backup(const filesystem::path& pathDest)
+{
+    LOCK(cs);
+    if (!WritePendingLocked())
+        return false;
+    if (fileAppend)
+        FileCommit(fileAppend);
+    try {
+#if BOOST_VERSION >= 104000
+        filesystem::copy_file(path, pathDest, filesystem::copy_option::overwrite_if_exists);
+#else
+        filesystem::copy_file(path, pathDest);
+#endif
+    } catch(const filesystem::filesystem_error &e) {
+        return error("CWalletLog::Backup() : copying %s to %s failed - %s", path.string().c_str(), pathDest.string().c_str(), e.what());
+    }
+    return true;
+}
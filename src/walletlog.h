@@ -0,0 +1,101 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_WALLETLOG_H
+#define BITCOIN_WALLETLOG_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "version.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Append-only, checksummed log of key/value records, held as an ordered map in memory.
+ *
+ *  Changes are appended in frames, each with its size and a checksum of its contents.
+ *  On load the file is memory-mapped and replayed; a frame is applied only if it is
+ *  complete and intact, so a torn write at the end loses that frame and nothing before
+ *  it. A damaged frame with more data after it fails the load and the file is left as
+ *  it is. A transaction goes into a single frame. Changes outside a transaction are
+ *  collected and appended together when a handle commits or closes (group commit).
+ *  Frames are handed to the OS when appended, and synced to disk by Flush. Once the
+ *  log has grown well past its live records, Flush rewrites it with only those.
+ */
+class CWalletLog
+{
+public:
+    typedef CSerializeData Data;
+
+    // Order keys as unsigned bytes, like the Berkeley DB btree, so ranges of
+    // serialized keys with a common prefix are read in the same order
+    struct CompareData
+    {
+        bool operator()(const Data& a, const Data& b) const;
+    };
+    typedef std::map<Data, Data, CompareData> DataMap;
+
+    /** Changes of an open transaction: already visible, written on commit, undone on abort */
+    class CBatch
+    {
+    public:
+        CDataStream ssOps;
+        std::vector<std::pair<Data, std::pair<bool, Data> > > vUndo; // key, (existed, old value)
+
+        CBatch() : ssOps(SER_DISK, CLIENT_VERSION) {}
+    };
+
+private:
+    mutable CCriticalSection cs;
+    boost::filesystem::path path;
+    FILE *fileAppend;
+    DataMap mapData;
+    CDataStream ssPending;   // changes outside transactions, not yet appended
+    int nBatchesOpen;
+    int64 nFileSize;
+    int64 nLiveSize;         // size of the records in mapData as they would be written
+
+    void Apply(const Data& key, const Data* pvalue);
+    bool Load();
+    bool WritePendingLocked();
+    bool CompactLocked(const char* pszSkip);
+
+public:
+    explicit CWalletLog(const boost::filesystem::path& pathIn);
+    ~CWalletLog();
+private:
+    CWalletLog(const CWalletLog&);
+    void operator=(const CWalletLog&);
+
+public:
+    static bool IsLogFile(const boost::filesystem::path& pathFile);
+
+    // Load the log, or create an empty one if the file does not exist
+    bool Open();
+
+    bool Read(const Data& key, Data& value) const;
+    bool Exists(const Data& key) const;
+    bool Write(const Data& key, const Data& value, bool fOverwrite, CBatch* pbatch);
+    bool Erase(const Data& key, CBatch* pbatch);
+
+    // The first record with a key after key (or not before it, if fInclusive)
+    bool Seek(const Data& key, bool fInclusive, Data& keyRet, Data& valueRet) const;
+
+    CBatch* TxnBegin();
+    bool TxnCommit(CBatch* pbatch);
+    void TxnAbort(CBatch* pbatch);
+
+    // Append the changes made outside transactions
+    bool WritePending();
+    // Append pending changes and sync the log to disk; compact it if worthwhile and allowed
+    bool Flush(bool fCompact = true);
+    // Rewrite the log with the live records only, dropping those whose key starts with pszSkip
+    bool Compact(const char* pszSkip = NULL);
+    // Sync the log and copy it to pathDest
+    bool Backup(const boost::filesystem::path& pathDest);
+};
+
+#endif // BITCOIN_WALLETLOG_H